@@ -21,8 +21,36 @@
 #include <boost/unordered_map.hpp>
 #include <boost/tuple/tuple.hpp> 
 #include <boost/tuple/tuple_io.hpp> 
+#include <boost/tuple/tuple_comparison.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
 #include <boost/graph/iteration_macros.hpp>
+#include <thread>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <queue>
+#include <chrono>
+#include <stdexcept>
+#include <sstream>
+#include <list>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <csignal>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cstring>
+#endif
 #ifdef DEBUG
 #define DEBUG_MSG(str) do { std::cout << str << std::endl; } while( false )
 #else
@@ -30,8 +58,44 @@
 #endif
 
 //Parameters for the MC algorithm
-int WEIGHTED = 0;
-int MAXITS  = 10000;
+struct params_t
+{
+    int WEIGHTED = 0;
+    int MAXITS  = 10000;
+    //Number of independent chains, each runs MAXITS iterations
+    int CHAINS = 1;
+    //Seed of chain k is SEED+k
+    unsigned int SEED = 5489;
+    //Print a diagnostics summary every REPORT iterations (0 = off)
+    int REPORT = 0;
+    //Diagnostics output file (defaults to <output file>.diag when CHAINS>1)
+    std::string DIAG = "";
+    //Sampler: "bgl" (boost::random_spanning_tree), "csr" (Wilson's algorithm on a CSR graph)
+    //or "parallel" (cycle popping on the CSR graph by THREADS threads per tree)
+    std::string ENGINE = "bgl";
+    //Threads building every tree of the parallel engine (0 = all cores)
+    int THREADS = 0;
+    //Vertex relabeling of the CSR graph: none, bfs, rcm or degree
+    std::string REORDER = "none";
+    //Print sampling throughput (and hardware cache counters where available)
+    int TIMING = 0;
+    //Weight columns file: sample every column over the same csr graph
+    std::string WEIGHTS = "";
+    //Edge pair co-occurrence: file of selected input edges, or "all" for a sketch
+    std::string PAIRS = "";
+    //Memory budget of the pair accumulators in MB (all chains together)
+    int PAIRMEM = 64;
+    //Number of heaviest pairs reported by the all pairs sketch
+    int HEAVY = 100;
+    //Tree bank file for importance reweighting across weight changes
+    std::string BANK = "";
+    //Resample when the ESS of the reweighted bank is below MINESS*(bank size)
+    double MINESS = 0.5;
+    //Print a dot per iteration (command line only)
+    bool progress = true;
+};
+//Parameters given on the command line
+params_t PARAMS;
 
 
 //Defining types
@@ -39,208 +103,2338 @@ typedef boost::property<boost::edge_weight_t, double> EdgeWeightProperty;
 typedef boost::adjacency_list < 
     boost::vecS, boost::vecS, boost::directedS,
     boost::no_property,EdgeWeightProperty > digraph_t;
-typedef boost::unordered_map<std::string,double> unordered_map;
-boost::random::mt19937 rng;
+typedef boost::unordered_map<std::string,int> unordered_map;
 #define getKey(v1,v2) std::to_string((long long unsigned int)v1)+"->"+std::to_string((long long unsigned int)v2)
 
-void initializeGraph(std::vector<boost::tuple<int,int,double> > edgeList, 
+/*
+Compressed sparse row digraph, vertices are stored under their relabeled ids.
+Out-edges of u are [rowStart[u],rowStart[u+1]), sorted by target. The slot
+of an edge is the position of its first copy in this order. For every edge
+u->t, slot is the slot counted when the walk leaves u through it (the edge
+t->u, matching the predecessor convention of the bgl engine).
+cumWeight holds n_columns weight columns (prefix sums within every row) one
+after the other, all sharing the same adjacency.
+*/
+struct csr_digraph_t
+{
+    int n;
+    int n_columns;
+    std::vector<int> rowStart;
+    std::vector<int> target;
+    std::vector<double> cumWeight;
+    std::vector<int> slot;
+    std::vector<int> label;
+};
+
+/*
+The csr graph, sampled by parallel cycle popping
+*/
+struct parallel_digraph_t
+{
+    const csr_digraph_t* csr;
+    int threads;
+};
+
+/*
+Scratch space of one sampler
+*/
+struct workspace_t
+{
+    std::vector<int> predecessors;
+    std::vector<int> nextEdge;
+    std::vector<char> inTree;
+    std::vector<int> slots;
+    int root;
+    //Weight column of the csr graph used by this sampler
+    int column;
+    const unordered_map* edgeSlot;
+    //Cycle popping: stack depth and owner of every vertex
+    std::vector<int> depth;
+    std::unique_ptr<std::atomic<int>[]> owner;
+    int n_owner = 0;
+};
+
+/*
+Pair co-occurrence accumulator of one chain. For a subset of edges, the
+number of trees containing both edges of a pair is kept exactly in a sparse
+map keyed by the ranks of the two slots in the subset. For all pairs, a
+count-min sketch of depth rows of width counters is kept instead, together
+with the heavy most frequent pairs seen so far.
+*/
+struct pairs_t
+{
+    //0 = off, 1 = edge subset, 2 = all pairs sketch
+    int mode = 0;
+    //Rank of every slot (-1 if not selected) and slot of every rank, subset only
+    const std::vector<int>* rank = NULL;
+    const std::vector<int>* rankSlot = NULL;
+    //Pair (a,b), a<b, has key a*n_keys+b
+    long long n_keys = 0;
+    boost::unordered_map<long long,unsigned> counts;
+    int depth = 0;
+    size_t width = 0;
+    std::vector<unsigned> sketch;
+    //Number of pairs added to the sketch
+    double total = 0;
+    size_t heavy = 0;
+    std::set<std::pair<unsigned,long long> > top;
+    boost::unordered_map<long long,unsigned> topCount;
+    std::vector<long long> present;
+    std::vector<size_t> buckets;
+};
+
+/*
+State of one independent chain. Roots and edges are tracked as a single
+vector of indicators: [0,V) are the roots and [V,V+S) the edge slots.
+Batch means (batches of batchSize iterations) give the Monte Carlo error.
+*/
+struct chain_t
+{
+    boost::random::mt19937 rng;
+    int n;
+    int batches;
+    std::vector<double> count;
+    std::vector<double> batchStart;
+    std::vector<double> batchSq;
+    int batchSize;
+    //Parent of every vertex (-1 at the root) of every sampled tree, if kept
+    bool keepTrees;
+    std::vector<int> trees;
+    //Weight column sampled by this chain
+    int column;
+    pairs_t pairs;
+};
+
+/*
+Summary of one root/edge indicator pooled over all chains
+*/
+struct diag_t
+{
+    double mean, mcse, ess, rhat;
+};
+
+/*
+Read the next "src,dest,weight" line of the input, skipping malformed lines
+*/
+bool readEdge(std::istream& in,int* v1,int* v2,double* wt)
+{
+    std::string line;
+    while(getline(in,line))
+    {
+        if(sscanf(line.c_str(),"%d,%d,%lf",v1,v2,wt)==3)
+            return true;
+    }
+    return false;
+}
+
+/*
+Stream the edges of the input into g, which gets the n_vertices vertices.
+Every distinct edge "v1->v2" is mapped to a slot in [0,S) and inputSlot
+receives the slot of every input edge.
+*/
+void initializeGraph(std::istream& in, 
+                    int n_vertices,
                     digraph_t* g,
-                    unordered_map* map) 
+                    unordered_map* map,
+                    std::vector<int>* inputSlot) 
 {   
     int v1,v2;
     double wt;
-    boost::tuple<int,int,double> t;
-    BOOST_FOREACH ( t, edgeList)
+    while((int)num_vertices(*g)<n_vertices)
+        add_vertex(*g);
+    while(readEdge(in,&v1,&v2,&wt))
     {
-        v1 = boost::get<0>(t);
-        v2 = boost::get<1>(t);
-        wt = boost::get<2>(t);
         DEBUG_MSG("Loading: "<<v1<<"->"<<v2<<" : "<<wt);
+        if(v1<0 || v1>=n_vertices || v2<0 || v2>=n_vertices)
+            throw std::out_of_range("vertex of edge "+getKey(v1,v2)+" not in [0,N-1]");
 		//TODO: Investigate why 
 		//you have to use this hack. Likely assumption
 		//in BOOST library
         add_edge(v1,v2,100/wt,*g);
-        map->insert(unordered_map::value_type(getKey(v1,v2),0));
+        inputSlot->push_back(
+            map->insert(unordered_map::value_type(getKey(v1,v2),map->size())).first->second);
+    }
+}
+
+/*
+Compute the new vertex order (order[newId] = oldId) from the adjacency
+(out-edges) adj of the input graph
+*/
+void computeOrdering(int n_vertices,
+    const std::vector<int>& adjStart,
+    const std::vector<int>& adj,
+    std::string mode,
+    std::vector<int>* order)
+{
+    order->clear();
+    order->reserve(n_vertices);
+    std::vector<int> degree (n_vertices);
+    for(int v=0;v<n_vertices;v++)
+        degree[v] = adjStart[v+1]-adjStart[v];
+    if(mode=="none")
+    {
+        for(int v=0;v<n_vertices;v++)
+            order->push_back(v);
+        return;
+    }
+    if(mode=="degree")
+    {
+        //High degree vertices first, they are visited the most by the walk
+        for(int v=0;v<n_vertices;v++)
+            order->push_back(v);
+        std::stable_sort(order->begin(),order->end(),
+            [&degree](int a,int b){return degree[a]>degree[b];});
+        return;
+    }
+    //bfs / rcm: breadth first from a minimum degree vertex of every component
+    std::vector<int> byDegree;
+    for(int v=0;v<n_vertices;v++)
+        byDegree.push_back(v);
+    std::stable_sort(byDegree.begin(),byDegree.end(),
+        [&degree](int a,int b){return degree[a]<degree[b];});
+    std::vector<char> visited (n_vertices,0);
+    std::vector<int> nbrs;
+    for(int s=0;s<n_vertices;s++)
+    {
+        if(visited[byDegree[s]])
+            continue;
+        std::queue<int> Q;
+        Q.push(byDegree[s]);
+        visited[byDegree[s]] = 1;
+        while(!Q.empty())
+        {
+            int u = Q.front();
+            Q.pop();
+            order->push_back(u);
+            nbrs.assign(adj.begin()+adjStart[u],adj.begin()+adjStart[u+1]);
+            if(mode=="rcm")
+                std::stable_sort(nbrs.begin(),nbrs.end(),
+                    [&degree](int a,int b){return degree[a]<degree[b];});
+            for(size_t j=0;j<nbrs.size();j++)
+            {
+                if(!visited[nbrs[j]])
+                {
+                    visited[nbrs[j]] = 1;
+                    Q.push(nbrs[j]);
+                }
+            }
+        }
     }
+    if(mode=="rcm")
+        std::reverse(order->begin(),order->end());
+}
+
+/*
+Read the weight columns of the next input edge from a weights file
+(one line per input edge, columns separated by commas or spaces)
+*/
+void readWeights(std::istream& columns,int n_columns,std::vector<double>* w)
+{
+    std::string line;
+    if(!getline(columns,line))
+        throw std::runtime_error("weights file has fewer lines than edges");
+    std::replace(line.begin(),line.end(),',',' ');
+    std::istringstream fields (line);
+    w->clear();
+    double x;
+    while(fields>>x)
+        w->push_back(x);
+    if((int)w->size()!=n_columns)
+        throw std::runtime_error("weights file line \""+line+"\" does not have "
+                                 +std::to_string((long long)n_columns)+" columns");
 }
 
+/*
+Rewind the input to the first edge for another pass
+*/
+void rewindInput(std::istream& in,std::streampos start)
+{
+    in.clear();
+    if(start==std::streampos(-1) || in.seekg(start).fail())
+        throw std::runtime_error("cannot rewind the input, the csr engine needs a seekable file");
+}
 
 /*
-Given an edgeList, run the test case
+An edge of a later pass must fit the rows counted by the first one
 */
-void runTest(int n_vertices,
-	std::vector<boost::tuple<int,int,double> > edgeList,
-	unordered_map* edgeProb,
-	std::vector<double>* root_prob)
+void checkPass(bool fits)
 {
-    digraph_t g;
+    if(!fits)
+        throw std::runtime_error("input differs between passes, the csr engine needs a seekable file");
+}
 
-    initializeGraph(edgeList,&g,edgeProb);
-    for (unordered_map::iterator it = edgeProb->begin(); it != edgeProb->end(); ++it) 
-        DEBUG_MSG(it->first << ", " << it->second);
-    
-  	#ifdef DEBUG
-    BGL_FORALL_EDGES(e, g, digraph_t) 
+/*
+Stream the edges of the input into the CSR graph g, relabeling vertices
+according to reorder. The input is read twice (three times when reordering):
+out-degrees are counted first and the preallocated arrays are then filled
+in place, so no edge list is kept. inputSlot receives the slot of every
+input edge. If columns is given, the n_columns weight columns are read from
+it (in input edge order) instead of the weights of the input.
+*/
+void initializeGraph(std::istream& in, 
+                    int n_vertices,
+                    std::string reorder,
+                    std::istream* columns,
+                    int n_columns,
+                    csr_digraph_t* g,
+                    std::vector<int>* inputSlot) 
+{
+    std::streampos start = in.tellg();
+    int v1,v2;
+    double wt;
+    size_t n_edges = 0;
+    g->n = n_vertices;
+    g->rowStart.assign(n_vertices+1,0);
+    while(readEdge(in,&v1,&v2,&wt))
     {
-        std::cout<<e<<" W="<<get(boost::edge_weight, g, e)<<std::endl;
+        if(v1<0 || v1>=n_vertices || v2<0 || v2>=n_vertices)
+            throw std::out_of_range("vertex of edge "+getKey(v1,v2)+" not in [0,N-1]");
+        g->rowStart[v1+1]++;
+        n_edges++;
     }
-	for(int v=0;v<n_vertices;v++)
-	{
-		double weight_sum = 0;
-		BGL_FORALL_OUTEDGES(v, e, g, digraph_t) {std::cout<<e<<", ";weight_sum += get(get(boost::edge_weight,g), e);}
-		std::cout<<v<<"->"<<weight_sum<<std::endl;
-	}
-    #endif
-    std::vector<int> predecessors (n_vertices);
-	std::vector<double> edgeMap (edgeList.size());
-    
-    for(int i=0;i<n_vertices;i++)
+    for(int v=0;v<n_vertices;v++)
+        g->rowStart[v+1] += g->rowStart[v];
+    std::vector<int> fill;
+    if(reorder=="none")
     {
-        predecessors[i]=0;
-        (*root_prob)[i] = 0;
+        g->label.resize(n_vertices);
+        for(int v=0;v<n_vertices;v++)
+            g->label[v] = v;
     }
-    int root;
-    boost::random::uniform_int_distribution<> dist(0, n_vertices-1);
-    for(int i=1;i<=MAXITS;i++)
+    else
     {
-		std::cout<<".";
-		std::fill(predecessors.begin(),predecessors.end(),0);
-		if(i%500==0)
-		{
-			std::cout<<std::endl;
-		}
-        //Sample root uniformly 
-        root = dist(rng);
-        #ifdef DEBUG_L2 //Since the DEBUG_MSG macro prints newline
-            std::cout<<i<<"|"<<root<<"|,"<<std::flush;
-        #endif
-		if(WEIGHTED==1)
-		{
-        boost::random_spanning_tree(g,rng,
-            boost::predecessor_map(
-                boost::make_iterator_property_map(
-                    predecessors.begin(), get(boost::vertex_index, g)))
-            .root_vertex(root)
-			.weight_map(get(boost::edge_weight,g))
-								);
-		}
-		else
-		{
-        boost::random_spanning_tree(g,rng,
-            boost::predecessor_map(
-                boost::make_iterator_property_map(
-                    predecessors.begin(), get(boost::vertex_index, g)))
-            .root_vertex(root));
-		}
+        //Extra pass: adjacency in the original ids for the ordering
+        std::vector<int> adj (n_edges);
+        fill.assign(g->rowStart.begin(),g->rowStart.end()-1);
+        rewindInput(in,start);
+        size_t k = 0;
+        while(readEdge(in,&v1,&v2,&wt))
+        {
+            checkPass(v1>=0 && v1<n_vertices && fill[v1]<g->rowStart[v1+1]);
+            adj[fill[v1]++] = v2;
+            k++;
+        }
+        checkPass(k==n_edges);
+        computeOrdering(n_vertices,g->rowStart,adj,reorder,&g->label);
+    }
+    std::vector<int> newId (n_vertices);
+    for(int v=0;v<n_vertices;v++)
+        newId[g->label[v]] = v;
+    if(reorder!="none")
+    {
+        std::vector<int> rowStart (n_vertices+1,0);
+        for(int v=0;v<n_vertices;v++)
+            rowStart[newId[v]+1] = g->rowStart[v+1]-g->rowStart[v];
+        for(int v=0;v<n_vertices;v++)
+            rowStart[v+1] += rowStart[v];
+        g->rowStart.swap(rowStart);
+    }
+    if(columns==NULL)
+        n_columns = 1;
+    g->n_columns = n_columns;
+    g->target.resize(n_edges);
+    g->cumWeight.resize(n_columns*n_edges);
+    g->slot.resize(n_edges);
+    inputSlot->resize(n_edges);
+    fill.assign(g->rowStart.begin(),g->rowStart.end()-1);
+    rewindInput(in,start);
+    size_t j = 0;
+    std::vector<double> w;
+    while(readEdge(in,&v1,&v2,&wt))
+    {
+        checkPass(v1>=0 && v1<n_vertices && v2>=0 && v2<n_vertices
+                  && fill[newId[v1]]<g->rowStart[newId[v1]+1]);
+        int e = fill[newId[v1]]++;
+        g->target[e] = newId[v2];
+        //Same transformation of the weight as the bgl graph
+        if(columns==NULL)
+            g->cumWeight[e] = 100/wt;
+        else
+        {
+            readWeights(*columns,n_columns,&w);
+            for(int k=0;k<n_columns;k++)
+                g->cumWeight[k*n_edges+e] = 100/w[k];
+        }
+        (*inputSlot)[j++] = e;
+    }
+    checkPass(j==n_edges);
+    std::vector<int>().swap(fill);
+    std::vector<int>().swap(newId);
+
+    //Sort every row by target; position maps the filled position of an
+    //edge to its slot (the sorted position of its first copy)
+    std::vector<int> position (n_edges);
+    std::vector<std::pair<int,int> > row;
+    std::vector<double> rowWeight;
+    for(int u=0;u<n_vertices;u++)
+    {
+        int begin = g->rowStart[u], end = g->rowStart[u+1];
+        row.clear();
+        for(int e=begin;e<end;e++)
+            row.push_back(std::make_pair(g->target[e],e));
+        std::sort(row.begin(),row.end());
+        int first = begin;
+        for(size_t r=0;r<row.size();r++)
+        {
+            g->target[begin+r] = row[r].first;
+            if(r==0 || row[r].first!=row[r-1].first)
+                first = begin+r;
+            position[row[r].second] = first;
+        }
+        for(int k=0;k<n_columns;k++)
+        {
+            double* cw = &g->cumWeight[k*n_edges];
+            rowWeight.clear();
+            for(size_t r=0;r<row.size();r++)
+                rowWeight.push_back(cw[row[r].second]);
+            for(size_t r=0;r<row.size();r++)
+                cw[begin+r] = rowWeight[r]+(r>0 ? cw[begin+r-1] : 0);
+        }
+    }
+    for(size_t i=0;i<n_edges;i++)
+        (*inputSlot)[i] = position[(*inputSlot)[i]];
+    std::vector<int>().swap(position);
+    //Slot of the reverse edge
+    for(int u=0;u<n_vertices;u++)
+    {
+        for(int e=g->rowStart[u];e<g->rowStart[u+1];e++)
+        {
+            int t = g->target[e];
+            std::vector<int>::iterator r = std::lower_bound(
+                g->target.begin()+g->rowStart[t],g->target.begin()+g->rowStart[t+1],u);
+            if(r!=g->target.begin()+g->rowStart[t+1] && *r==u)
+                g->slot[e] = r-g->target.begin();
+            else
+                g->slot[e] = -1;
+        }
+    }
+}
+
+/*
+Sample a spanning tree rooted at root with boost::random_spanning_tree,
+ws->slots receives the slots of its edges. Returns the (original) root.
+*/
+int sampleTree(const digraph_t& g,
+    const params_t& P,
+    boost::random::mt19937& rng,
+    int root,
+    workspace_t* ws)
+{
+    int n_vertices = num_vertices(g);
+    ws->predecessors.resize(n_vertices);
+    std::fill(ws->predecessors.begin(),ws->predecessors.end(),0);
+    if(P.WEIGHTED==1)
+    {
+    boost::random_spanning_tree(g,rng,
+        boost::predecessor_map(
+            boost::make_iterator_property_map(
+                ws->predecessors.begin(), get(boost::vertex_index, g)))
+        .root_vertex(root)
+        .weight_map(get(boost::edge_weight,g))
+                            );
+    }
+    else
+    {
+    boost::random_spanning_tree(g,rng,
+        boost::predecessor_map(
+            boost::make_iterator_property_map(
+                ws->predecessors.begin(), get(boost::vertex_index, g)))
+        .root_vertex(root));
+    }
 #ifdef DEBUG
-		std::cout<<"Printing spanning tree rooted at "<<root<<std::endl;
+    std::cout<<"Printing spanning tree rooted at "<<root<<std::endl;
 #endif
-        //Update counts
-        (*root_prob)[root]+=1;
-        for(int i=0;i<n_vertices;i++)
+    ws->slots.clear();
+    for(int i=0;i<n_vertices;i++)
+    {
+        if(ws->predecessors[i]!=-1)
         {
-            if(predecessors[i]!=-1)
-            {
-                edgeProb->at(getKey(predecessors[i],i)) +=1;
+            ws->slots.push_back(ws->edgeSlot->at(getKey(ws->predecessors[i],i)));
 #ifdef DEBUG
-				std::cout<<predecessors[i]<<"--"<<i<<" Key: "<<getKey(predecessors[i],i)<<std::endl;
+            std::cout<<ws->predecessors[i]<<"--"<<i<<" Key: "<<getKey(ws->predecessors[i],i)<<std::endl;
 #endif
+        }
+        else
+        {
+            if(root!=i)
+                std::cout<<"Error. root="<<root<<" i="<<i<<std::endl;
+        }
+    }
+    return root;
+}
+
+/*
+Choose a random out-edge of u (proportional to its weight if weighted)
+*/
+inline int randomOutEdge(const csr_digraph_t& g,
+    int weighted,
+    const double* cumWeight,
+    boost::random::mt19937& rng,
+    int u)
+{
+    int begin = g.rowStart[u], end = g.rowStart[u+1];
+    if(begin==end)
+        throw boost::loop_erased_random_walk_stuck();
+    if(weighted==1)
+    {
+        boost::random::uniform_real_distribution<> r(0,cumWeight[end-1]);
+        int e = std::upper_bound(cumWeight+begin,cumWeight+end,r(rng))-cumWeight;
+        return std::min(e,end-1);
+    }
+    boost::random::uniform_int_distribution<> r(begin,end-1);
+    return r(rng);
+}
+
+/*
+Wilson's algorithm on the CSR graph: walks from every vertex (in CSR order)
+until the tree is hit, the last exit of every vertex is its tree edge.
+Returns the root in original ids.
+*/
+int sampleTree(const csr_digraph_t& g,
+    const params_t& P,
+    boost::random::mt19937& rng,
+    int root,
+    workspace_t* ws)
+{
+    ws->nextEdge.resize(g.n);
+    ws->inTree.assign(g.n,0);
+    ws->inTree[root] = 1;
+    ws->root = root;
+    const double* cumWeight = g.cumWeight.data()+(size_t)ws->column*g.target.size();
+    for(int i=0;i<g.n;i++)
+    {
+        int u = i;
+        while(!ws->inTree[u])
+        {
+            ws->nextEdge[u] = randomOutEdge(g,P.WEIGHTED,cumWeight,rng,u);
+            u = g.target[ws->nextEdge[u]];
+        }
+        u = i;
+        while(!ws->inTree[u])
+        {
+            ws->inTree[u] = 1;
+            u = g.target[ws->nextEdge[u]];
+        }
+    }
+    ws->slots.clear();
+    for(int v=0;v<g.n;v++)
+    {
+        if(v==root)
+            continue;
+        int e = ws->nextEdge[v];
+        if(g.slot[e]<0)
+            throw std::out_of_range("edge "+getKey(g.label[g.target[e]],g.label[v])+" not in graph");
+        ws->slots.push_back(g.slot[e]);
+    }
+    return g.label[root];
+}
+
+/*
+splitmix64 finalizer
+*/
+inline unsigned long long mix64(unsigned long long h)
+{
+    h = (h^(h>>30))*0xbf58476d1ce4e5b9ULL;
+    h = (h^(h>>27))*0x94d049bb133111ebULL;
+    return h^(h>>31);
+}
+
+/*
+Entry d of the stack of random out-edges of u used by cycle popping. The
+entries are drawn from a hash of (key,u,d), so every thread sees the same
+stacks and no random number generator is shared.
+*/
+inline int stackEdge(const csr_digraph_t& g,
+    int weighted,
+    const double* cumWeight,
+    unsigned long long key,
+    int u,
+    int d)
+{
+    int begin = g.rowStart[u], end = g.rowStart[u+1];
+    unsigned long long h = mix64(key^mix64(((unsigned long long)u<<32)|(unsigned)d));
+    double x = (h>>11)*(1.0/9007199254740992.0);
+    if(weighted==1)
+    {
+        int e = std::upper_bound(cumWeight+begin,cumWeight+end,x*cumWeight[end-1])-cumWeight;
+        return std::min(e,end-1);
+    }
+    return begin+(int)(x*(end-begin));
+}
+
+/*
+Owner of a vertex during cycle popping: free, in the tree, or the walker
+(1..threads) whose path holds it
+*/
+const int FREE = 0;
+const int IN_TREE = -1;
+
+/*
+One walker of the parallel cycle popping: walks from every vertex of its
+share that is not yet in the tree. The walker owns the vertices of its
+path, whose stack tops lead from the start to the head. A step that
+closes a cycle on the own path pops it (the stacks of its vertices
+advance); a step into the tree adds the path to the tree. A step into the
+path of another walker waits for it if that walker has a lower id and
+otherwise gives up the path, untouched, and walks again later: waits only
+go to lower ids, so they cannot deadlock. Since the popped cycles and the
+tree only depend on the stacks (Propp and Wilson), the tree is the one
+Wilson's algorithm gives with these stacks, whatever the interleaving.
+*/
+void popCycles(const csr_digraph_t& g,
+    int weighted,
+    const double* cumWeight,
+    unsigned long long key,
+    int walker,
+    int n_walkers,
+    workspace_t* ws)
+{
+    std::atomic<int>* owner = ws->owner.get();
+    for(int start=walker-1;start<g.n;start+=n_walkers)
+    {
+        int o;
+        while((o = owner[start].load(std::memory_order_acquire))!=IN_TREE)
+        {
+            if(o!=FREE || !owner[start].compare_exchange_strong(o,walker,std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+                continue;
             }
-            else
+            int head = start;
+            bool walking = true;
+            while(walking)
             {
-                if(root!=i)
-                    std::cout<<"Error. root="<<root<<" i="<<i<<std::endl;
+                int e = stackEdge(g,weighted,cumWeight,key,head,ws->depth[head]);
+                ws->nextEdge[head] = e;
+                int x = g.target[e];
+                o = owner[x].load(std::memory_order_acquire);
+                if(o==walker)
+                {
+                    //Pop the cycle x->...->head->x, x stays on the path
+                    int u = x;
+                    do
+                    {
+                        int next = g.target[ws->nextEdge[u]];
+                        ws->depth[u]++;
+                        if(u!=x)
+                            owner[u].store(FREE,std::memory_order_release);
+                        u = next;
+                    }
+                    while(u!=x);
+                    head = x;
+                }
+                else if(o==FREE && owner[x].compare_exchange_strong(o,walker,std::memory_order_acquire))
+                    head = x;
+                else if(o!=IN_TREE && o<walker)
+                    std::this_thread::yield();
+                else
+                {
+                    //Into the tree, or give up the path to a higher walker. The
+                    //next vertex is read before u is released: once free, u
+                    //may be claimed and its nextEdge rewritten at once
+                    int mark = o==IN_TREE ? IN_TREE : FREE;
+                    int u = start;
+                    while(true)
+                    {
+                        int next = g.target[ws->nextEdge[u]];
+                        owner[u].store(mark,std::memory_order_release);
+                        if(u==head)
+                            break;
+                        u = next;
+                    }
+                    walking = false;
+                    if(mark==FREE)
+                        std::this_thread::yield();
+                }
             }
-            
         }
+    }
+}
 
+/*
+Sample a tree rooted at root with threads walkers popping cycles
+concurrently; the tree has exactly the distribution of sampleTree on the
+csr graph
+*/
+int sampleTree(const parallel_digraph_t& pg,
+    const params_t& P,
+    boost::random::mt19937& rng,
+    int root,
+    workspace_t* ws)
+{
+    const csr_digraph_t& g = *pg.csr;
+    for(int v=0;v<g.n;v++)
+        if(v!=root && g.rowStart[v]==g.rowStart[v+1])
+            throw boost::loop_erased_random_walk_stuck();
+    ws->nextEdge.resize(g.n);
+    ws->depth.assign(g.n,0);
+    if(ws->n_owner!=g.n)
+    {
+        ws->owner.reset(new std::atomic<int>[g.n]);
+        ws->n_owner = g.n;
     }
-    DEBUG_MSG("");
+    for(int v=0;v<g.n;v++)
+        ws->owner[v].store(v==root ? IN_TREE : FREE,std::memory_order_relaxed);
+    ws->root = root;
+    const double* cumWeight = g.cumWeight.data()+(size_t)ws->column*g.target.size();
+    unsigned long long key = ((unsigned long long)rng()<<32)|rng();
+    std::vector<std::thread> walkers;
+    for(int w=2;w<=pg.threads;w++)
+        walkers.push_back(std::thread(popCycles,boost::cref(g),P.WEIGHTED,cumWeight,key,w,pg.threads,ws));
+    popCycles(g,P.WEIGHTED,cumWeight,key,1,pg.threads,ws);
+    for(size_t w=0;w<walkers.size();w++)
+        walkers[w].join();
+    ws->slots.clear();
+    for(int v=0;v<g.n;v++)
+    {
+        if(v==root)
+            continue;
+        int e = ws->nextEdge[v];
+        if(g.slot[e]<0)
+            throw std::out_of_range("edge "+getKey(g.label[g.target[e]],g.label[v])+" not in graph");
+        ws->slots.push_back(g.slot[e]);
+    }
+    return g.label[root];
+}
 
+/*
+Append the parents (original ids) of the last sampled tree to trees
+*/
+void appendTree(const digraph_t& g,
+    int n_vertices,
+    const workspace_t& ws,
+    std::vector<int>* trees)
+{
+    for(int i=0;i<n_vertices;i++)
+        trees->push_back(i<(int)ws.predecessors.size() ? ws.predecessors[i] : -1);
 }
 
-int MCMC_spanning_tree(std::string fileIN,std::string fileOUT)
+void appendTree(const csr_digraph_t& g,
+    int n_vertices,
+    const workspace_t& ws,
+    std::vector<int>* trees)
 {
-	//Read graph structure from fileIN
-	int v1,v2,n_vertices,n_edges = 0;
-	std::vector< boost::tuple<int,int,double> > edgeList;
-	std::string line;
-	double weight;
-	std::ifstream inputf (fileIN.c_str());
-	if(inputf.is_open())
-	{
-		getline(inputf,line);
-		sscanf(line.c_str(),"%d",&n_vertices);
-		while(getline(inputf,line))
-		{
-			sscanf (line.c_str(),"%d,%d,%lf",&v1,&v2,&weight);
-			//Assumes vertices start from 0...N-1
-			edgeList.push_back(boost::make_tuple(v1,v2,weight));
-			n_edges++;
-		}
-		inputf.close();
-	}
-	else
-	{
-		std::cerr<<"Input file not found. Cannot be opened\n";
-		return EXIT_FAILURE;
-	}
+    size_t start = trees->size();
+    trees->resize(start+n_vertices);
+    for(int v=0;v<g.n;v++)
+        (*trees)[start+g.label[v]] = v==ws.root ? -1 : g.label[g.target[ws.nextEdge[v]]];
+}
 
-	std::vector<double> root_prob (n_vertices);
-    unordered_map edgeProb;
-    runTest(n_vertices,edgeList, &edgeProb, &root_prob);
-    DEBUG_MSG("---RESULT---");
+void appendTree(const parallel_digraph_t& g,
+    int n_vertices,
+    const workspace_t& ws,
+    std::vector<int>* trees)
+{
+    appendTree(*g.csr,n_vertices,ws,trees);
+}
 
-    
-    std::ofstream outputf (fileOUT.c_str());
+/*
+Close the current batch of every indicator of a chain
+*/
+void closeBatch(chain_t* c)
+{
+    for(size_t q=0;q<c->count.size();q++)
+    {
+        double m = (c->count[q]-c->batchStart[q])/c->batchSize;
+        c->batchSq[q] += m*m;
+        c->batchStart[q] = c->count[q];
+    }
+    c->batches++;
+}
 
-    //Normalize root and edge probabilities
-    for (int i=0;i<n_vertices;i++)
+/*
+Bucket of key in row r of a count-min sketch of the given width
+*/
+inline size_t sketchBucket(long long key,int r,size_t width)
+{
+    return mix64((unsigned long long)key+0x9e3779b97f4a7c15ULL*(r+1))%width;
+}
+
+/*
+Count-min estimate (an upper bound) of the count of key
+*/
+unsigned sketchEstimate(const pairs_t& p,long long key)
+{
+    unsigned est = std::numeric_limits<unsigned>::max();
+    for(int r=0;r<p.depth;r++)
+        est = std::min(est,p.sketch[r*p.width+sketchBucket(key,r,p.width)]);
+    return est;
+}
+
+/*
+Add every pair of selected edges of the tree with the given slots
+*/
+void addPairs(const std::vector<int>& slots,pairs_t* p)
+{
+    p->present.clear();
+    for(size_t j=0;j<slots.size();j++)
     {
-    	outputf<<(root_prob[i]/MAXITS);
-    	outputf<<" ";
-        DEBUG_MSG("Node "<<i<<" : " << (root_prob[i]/MAXITS));
+        int a = p->mode==1 ? (*p->rank)[slots[j]] : slots[j];
+        if(a>=0)
+            p->present.push_back(a);
     }
-    outputf<<"\n";
-    boost::tuple<int,int,double> t;
-    BOOST_FOREACH(t,edgeList)
+    std::sort(p->present.begin(),p->present.end());
+    for(size_t a=0;a<p->present.size();a++)
     {
-    	line = getKey(boost::get<0>(t),boost::get<1>(t));
-    	DEBUG_MSG(boost::get<0>(t)<<"->"<<
-    	    	  boost::get<1>(t)<<" : "<<(edgeProb.at(line)/MAXITS));
-    	outputf<<(edgeProb.at(line)/MAXITS);
-    	outputf<<" ";
+        if(p->mode==1)
+        {
+            for(size_t b=a+1;b<p->present.size();b++)
+                p->counts[p->present[a]*p->n_keys+p->present[b]]++;
+            continue;
+        }
+        //The counters of a pair are scattered over the sketch: locate and
+        //prefetch those of all pairs of this row before touching any
+        p->buckets.clear();
+        for(size_t b=a+1;b<p->present.size();b++)
+        {
+            long long key = p->present[a]*p->n_keys+p->present[b];
+            for(int r=0;r<p->depth;r++)
+            {
+                size_t q = r*p->width+sketchBucket(key,r,p->width);
+                __builtin_prefetch(&p->sketch[q],1);
+                p->buckets.push_back(q);
+            }
+        }
+        for(size_t b=a+1;b<p->present.size();b++)
+        {
+            long long key = p->present[a]*p->n_keys+p->present[b];
+            const size_t* q = &p->buckets[(b-a-1)*p->depth];
+            unsigned est = std::numeric_limits<unsigned>::max();
+            for(int r=0;r<p->depth;r++)
+                est = std::min(est,++p->sketch[q[r]]);
+            p->total++;
+            //Keep the heavy largest estimates. A tracked key was at least
+            //the minimum before this increment so it is now above it: an
+            //estimate not above the minimum of a full set cannot enter it.
+            if(p->topCount.size()==p->heavy && est<=p->top.begin()->first)
+                continue;
+            boost::unordered_map<long long,unsigned>::iterator it = p->topCount.find(key);
+            if(it!=p->topCount.end())
+            {
+                p->top.erase(std::make_pair(it->second,key));
+                it->second = est;
+            }
+            else if(p->topCount.size()<p->heavy)
+                p->topCount[key] = est;
+            else
+            {
+                p->topCount.erase(p->top.begin()->second);
+                p->top.erase(p->top.begin());
+                p->topCount[key] = est;
+            }
+            p->top.insert(std::make_pair(est,key));
+        }
     }
+}
 
-	return EXIT_SUCCESS;
+/*
+Pool indicator q over all chains: mean, batch means MCSE, effective
+sample size and the Gelman-Rubin potential scale reduction factor
+*/
+diag_t diagnose(const std::vector<chain_t>& chains,size_t q)
+{
+    diag_t d;
+    int K = chains.size();
+    double n = chains[0].n;
+    double sum = 0, W = 0, sigma2 = 0, batchesUsed = 0;
+    for(int k=0;k<K;k++)
+        sum += chains[k].count[q];
+    d.mean = sum/(K*n);
+    std::vector<double> p (K);
+    for(int k=0;k<K;k++)
+    {
+        const chain_t& c = chains[k];
+        p[k] = c.count[q]/n;
+        W += p[k]*(1-p[k])*(n>1?n/(n-1):1);
+        //Batch means variance estimate (needs at least two batches)
+        if(c.batches>=2)
+        {
+            double a = c.batches;
+            double mbar = c.batchStart[q]/(a*c.batchSize);
+            sigma2 += c.batchSize*(c.batchSq[q]-a*mbar*mbar)/(a-1);
+            batchesUsed++;
+        }
+    }
+    W /= K;
+    if(batchesUsed>0)
+    {
+        sigma2 /= batchesUsed;
+        d.mcse = std::sqrt(std::max(sigma2,0.0)/(K*n));
+        d.ess = sigma2>0 ? K*n*W/sigma2 : K*n;
+    }
+    else
+    {
+        d.mcse = std::numeric_limits<double>::quiet_NaN();
+        d.ess = std::numeric_limits<double>::quiet_NaN();
+    }
+    //R-hat
+    if(K<2)
+        d.rhat = std::numeric_limits<double>::quiet_NaN();
+    else
+    {
+        double B = 0;
+        for(int k=0;k<K;k++)
+            B += (p[k]-d.mean)*(p[k]-d.mean);
+        B *= n/(K-1);
+        if(W>0)
+            d.rhat = std::sqrt(((n-1)/n*W+B/n)/W);
+        else
+            d.rhat = B>0 ? std::numeric_limits<double>::infinity() : 1;
+    }
+    return d;
 }
 
-std::string PNAME = "MCMC_spanning_tree";
-int main(int argc,char* argv[])
+/*
+One line summary: worst R-hat, ESS and MCSE over all indicators
+*/
+void reportDiagnostics(const std::vector<chain_t>& chains,int column,int n_columns)
 {
-	if (argc < 3)
-	{
+    double maxRhat = 0, minEss = std::numeric_limits<double>::infinity(), maxMcse = 0;
+    for(size_t q=0;q<chains[0].count.size();q++)
+    {
+        diag_t d = diagnose(chains,q);
+        if(d.rhat>maxRhat) maxRhat = d.rhat;
+        if(d.ess<minEss) minEss = d.ess;
+        if(d.mcse>maxMcse) maxMcse = d.mcse;
+    }
+    std::cout<<"[diag] it="<<chains[0].n<<" chains="<<chains.size();
+    if(n_columns>1)
+        std::cout<<" column="<<column;
+    if(chains.size()>1)
+        std::cout<<" max R-hat="<<maxRhat;
+    if(chains[0].batches>=2)
+        std::cout<<" min ESS="<<minEss<<" max MCSE="<<maxMcse;
+    std::cout<<std::endl;
+}
+
+
+/*
+An input graph built for one engine, ready for sampling
+*/
+struct graph_t
+{
+    int n_vertices;
+    std::string engine;
+    std::string reorder;
+    int n_slots;
+    int n_columns;
+    //Slots of the bgl graph (the csr graph numbers its edges itself)
+    unordered_map edgeSlot;
+    //Slot of every edge of the input file, in input order
+    std::vector<int> inputSlot;
+    digraph_t bgl;
+    csr_digraph_t csr;
+};
+
+/*
+Run one chain of every weight column for their next 'iterations' samples.
+The columns take turns, so they all walk the same adjacency while it is in
+cache.
+*/
+template <typename Graph>
+void runChain(const Graph& g,
+    const params_t& P,
+    int n_vertices,
+    const unordered_map& edgeSlot,
+    std::vector<chain_t*> group,
+    int iterations,
+    bool verbose)
+{
+    workspace_t ws;
+    ws.edgeSlot = &edgeSlot;
+    int root;
+    boost::random::uniform_int_distribution<> dist(0, n_vertices-1);
+    for(int it=0;it<iterations;it++)
+    {
+        for(size_t k=0;k<group.size();k++)
+        {
+        chain_t* chain = group[k];
+        ws.column = chain->column;
+        chain->n++;
+        if(verbose && k==0)
+        {
+            std::cout<<".";
+            if(chain->n%500==0)
+            {
+                std::cout<<std::endl;
+            }
+        }
+        //Sample root uniformly 
+        root = dist(chain->rng);
+        #ifdef DEBUG_L2 //Since the DEBUG_MSG macro prints newline
+            std::cout<<chain->n<<"|"<<root<<"|,"<<std::flush;
+        #endif
+        root = sampleTree(g,P,chain->rng,root,&ws);
+        //Update counts
+        chain->count[root]+=1;
+        for(size_t j=0;j<ws.slots.size();j++)
+            chain->count[n_vertices+ws.slots[j]] +=1;
+        if(chain->keepTrees)
+            appendTree(g,n_vertices,ws,&chain->trees);
+        if(chain->pairs.mode!=0)
+            addPairs(ws.slots,&chain->pairs);
+        if(chain->n%chain->batchSize==0)
+            closeBatch(chain);
+        }
+    }
+}
+
+/*
+runChain keeping any exception in error, so that a failing chain neither
+ends its thread with std::terminate nor skips joining the others
+*/
+template <typename Graph>
+void runChainCaught(const Graph& g,
+    const params_t& P,
+    int n_vertices,
+    const unordered_map& edgeSlot,
+    std::vector<chain_t*> group,
+    int iterations,
+    bool verbose,
+    std::exception_ptr* error)
+{
+    try
+    {
+        runChain(g,P,n_vertices,edgeSlot,group,iterations,verbose);
+    }
+    catch(...)
+    {
+        *error = std::current_exception();
+    }
+}
+
+#ifdef __linux__
+/*
+Hardware cache counters of this process (and the threads it spawns)
+*/
+int openCounter(unsigned long long config)
+{
+    struct perf_event_attr attr;
+    memset(&attr,0,sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open,&attr,0,-1,-1,0);
+}
+#endif
+
+/*
+Run P.CHAINS chains of P.MAXITS iterations for every weight column of graph g
+*/
+template <typename Graph>
+void runChains(const Graph& g,
+    const params_t& P,
+    int n_vertices,
+    int n_slots,
+    int n_columns,
+    const unordered_map& edgeSlot,
+    const pairs_t& pairs,
+    std::vector<std::vector<chain_t> >* columns)
+{
+    columns->resize(n_columns);
+    for(int col=0;col<n_columns;col++)
+    {
+    std::vector<chain_t>* chains = &(*columns)[col];
+    chains->resize(P.CHAINS);
+    for(int k=0;k<P.CHAINS;k++)
+    {
+        chain_t& c = (*chains)[k];
+        //Columns share the seeds (common random numbers across columns)
+        c.rng.seed(P.SEED+k);
+        c.column = col;
+        c.n = 0;
+        c.batches = 0;
+        //sqrt(n) batches of sqrt(n) samples each
+        c.batchSize = std::max(1,(int)std::sqrt((double)P.MAXITS));
+        c.count.assign(n_vertices+n_slots,0);
+        c.batchStart.assign(c.count.size(),0);
+        c.batchSq.assign(c.count.size(),0);
+        c.keepTrees = !P.BANK.empty();
+        c.trees.clear();
+        c.pairs = pairs;
+        c.pairs.sketch.assign(pairs.depth*pairs.width,0);
+        //Every pair of the subset fits the budget, so avoid rehashing
+        if(pairs.mode==1)
+            c.pairs.counts.reserve(pairs.n_keys*(pairs.n_keys-1)/2);
+    }
+    }
+    int refs = -1, misses = -1;
+#ifdef __linux__
+    if(P.TIMING)
+    {
+        refs = openCounter(PERF_COUNT_HW_CACHE_REFERENCES);
+        misses = openCounter(PERF_COUNT_HW_CACHE_MISSES);
+        if(refs>=0) ioctl(refs,PERF_EVENT_IOC_ENABLE,0);
+        if(misses>=0) ioctl(misses,PERF_EVENT_IOC_ENABLE,0);
+    }
+#endif
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    //Chains run in parallel in rounds of REPORT iterations
+    int done = 0;
+    while(done<P.MAXITS)
+    {
+        int step = P.MAXITS-done;
+        if(P.REPORT>0 && P.REPORT<step)
+            step = P.REPORT;
+        std::vector<std::thread> workers;
+        std::vector<std::vector<chain_t*> > groups (P.CHAINS);
+        std::vector<std::exception_ptr> errors (P.CHAINS);
+        for(int k=0;k<P.CHAINS;k++)
+            for(int col=0;col<n_columns;col++)
+                groups[k].push_back(&(*columns)[col][k]);
+        for(int k=1;k<P.CHAINS;k++)
+            workers.push_back(std::thread(runChainCaught<Graph>,boost::cref(g),boost::cref(P),n_vertices,
+                boost::cref(edgeSlot),groups[k],step,false,&errors[k]));
+        runChainCaught(g,P,n_vertices,edgeSlot,groups[0],step,
+                 P.progress && P.REPORT==0 && P.TIMING==0,&errors[0]);
+        for(size_t w=0;w<workers.size();w++)
+            workers[w].join();
+        for(int k=0;k<P.CHAINS;k++)
+        {
+            if(errors[k])
+            {
+#ifdef __linux__
+                if(refs>=0) close(refs);
+                if(misses>=0) close(misses);
+#endif
+                std::rethrow_exception(errors[k]);
+            }
+        }
+        done += step;
+        if(P.REPORT>0)
+            for(int col=0;col<n_columns;col++)
+                reportDiagnostics((*columns)[col],col,n_columns);
+    }
+    if(P.TIMING)
+    {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        std::cout<<"[timing] engine="<<P.ENGINE<<" reorder="<<P.REORDER<<" seconds="<<secs
+                 <<" columns="<<n_columns<<" trees/s="<<(double)n_columns*P.CHAINS*P.MAXITS/secs;
+#ifdef __linux__
+        long long nrefs = 0, nmisses = 0;
+        if(refs>=0 && misses>=0 && read(refs,&nrefs,sizeof(nrefs))==sizeof(nrefs)
+           && read(misses,&nmisses,sizeof(nmisses))==sizeof(nmisses) && nrefs>0)
+            std::cout<<" cache-refs="<<nrefs<<" cache-misses="<<nmisses
+                     <<" miss-rate="<<(double)nmisses/nrefs;
+        else
+            std::cout<<" miss-rate=n/a";
+        if(refs>=0) close(refs);
+        if(misses>=0) close(misses);
+#endif
+        std::cout<<std::endl;
+    }
+}
+
+/*
+Load a graph in the input file format for engine P.ENGINE
+*/
+/*
+Every vertex must reach every other one, otherwise a walk toward some roots
+never ends: breadth first search from vertex 0 over the out-edges
+[rowStart[u],rowStart[u+1]) of target and over the reversed edges. label
+gives the input id of a vertex (NULL if unchanged) for the message.
+*/
+void checkStronglyConnected(int n_vertices,
+    const std::vector<int>& rowStart,
+    const std::vector<int>& target,
+    const std::vector<int>* label)
+{
+    std::vector<int> reverseStart (n_vertices+1,0), reverse (target.size());
+    for(size_t e=0;e<target.size();e++)
+        reverseStart[target[e]+1]++;
+    for(int v=0;v<n_vertices;v++)
+        reverseStart[v+1] += reverseStart[v];
+    std::vector<int> fill (reverseStart.begin(),reverseStart.end()-1);
+    for(int u=0;u<n_vertices;u++)
+        for(int e=rowStart[u];e<rowStart[u+1];e++)
+            reverse[fill[target[e]]++] = u;
+    std::vector<int>().swap(fill);
+    for(int pass=0;pass<2;pass++)
+    {
+        const std::vector<int>& start = pass==0 ? rowStart : reverseStart;
+        const std::vector<int>& adj = pass==0 ? target : reverse;
+        std::vector<char> seen (n_vertices,0);
+        std::vector<int> queue (1,0);
+        seen[0] = 1;
+        for(size_t q=0;q<queue.size();q++)
+            for(int e=start[queue[q]];e<start[queue[q]+1];e++)
+                if(!seen[adj[e]])
+                {
+                    seen[adj[e]] = 1;
+                    queue.push_back(adj[e]);
+                }
+        for(int v=0;v<n_vertices;v++)
+            if(!seen[v])
+                throw std::runtime_error("graph is not strongly connected: vertex "
+                    +std::to_string((long long)(label ? (*label)[v] : v))
+                    +(pass==0 ? " is not reachable from" : " cannot reach")+" vertex "
+                    +std::to_string((long long)(label ? (*label)[0] : 0)));
+    }
+}
+
+bool loadGraph(std::istream& in,
+    const params_t& P,
+    graph_t* g)
+{
+    std::string line;
+    if(!getline(in,line) || sscanf(line.c_str(),"%d",&g->n_vertices)!=1 || g->n_vertices<1)
+        return false;
+    g->engine = P.ENGINE;
+    g->reorder = P.REORDER;
+    if(P.ENGINE!="bgl")
+    {
+        std::ifstream columns;
+        int n_columns = 0;
+        if(!P.WEIGHTS.empty())
+        {
+            //Number of columns from the first line
+            columns.open(P.WEIGHTS.c_str());
+            if(!columns.is_open() || !getline(columns,line))
+                throw std::runtime_error("cannot read weights file "+P.WEIGHTS);
+            std::replace(line.begin(),line.end(),',',' ');
+            std::istringstream fields (line);
+            double x;
+            while(fields>>x)
+                n_columns++;
+            if(n_columns<1)
+                throw std::runtime_error("weights file "+P.WEIGHTS+" has no columns");
+            rewindInput(columns,0);
+        }
+        initializeGraph(in,g->n_vertices,P.REORDER,P.WEIGHTS.empty() ? NULL : &columns,
+                        n_columns,&g->csr,&g->inputSlot);
+        g->n_slots = g->csr.target.size();
+        g->n_columns = g->csr.n_columns;
+        checkStronglyConnected(g->n_vertices,g->csr.rowStart,g->csr.target,&g->csr.label);
+        return true;
+    }
+    initializeGraph(in,g->n_vertices,&g->bgl,&g->edgeSlot,&g->inputSlot);
+    g->n_slots = g->edgeSlot.size();
+    g->n_columns = 1;
+    std::vector<int> rowStart (1,0), target;
+    for(int v=0;v<g->n_vertices;v++)
+    {
+        BGL_FORALL_ADJ(v, t, g->bgl, digraph_t)
+            target.push_back(t);
+        rowStart.push_back(target.size());
+    }
+    checkStronglyConnected(g->n_vertices,rowStart,target,NULL);
+    for (unordered_map::iterator it = g->edgeSlot.begin(); it != g->edgeSlot.end(); ++it) 
+        DEBUG_MSG(it->first << ", " << it->second);
+    
+  	#ifdef DEBUG
+    BGL_FORALL_EDGES(e, g->bgl, digraph_t) 
+    {
+        std::cout<<e<<" W="<<get(boost::edge_weight, g->bgl, e)<<std::endl;
+    }
+	for(int v=0;v<g->n_vertices;v++)
+	{
+		double weight_sum = 0;
+		BGL_FORALL_OUTEDGES(v, e, g->bgl, digraph_t) {std::cout<<e<<", ";weight_sum += get(get(boost::edge_weight,g->bgl), e);}
+		std::cout<<v<<"->"<<weight_sum<<std::endl;
+	}
+    #endif
+    return true;
+}
+
+/*
+Given a graph, run P.CHAINS independent chains of P.MAXITS iterations for
+every weight column, accumulating edge pairs as configured by pairs
+*/
+void runTest(const graph_t& g,
+	const params_t& P,
+	const pairs_t& pairs,
+	std::vector<std::vector<chain_t> >* columns)
+{
+    if(g.engine=="parallel")
+    {
+        parallel_digraph_t pg;
+        pg.csr = &g.csr;
+        pg.threads = P.THREADS>0 ? P.THREADS : std::max(1u,std::thread::hardware_concurrency());
+        runChains(pg,P,g.n_vertices,g.n_slots,g.n_columns,g.edgeSlot,pairs,columns);
+    }
+    else if(g.engine=="csr")
+        runChains(g.csr,P,g.n_vertices,g.n_slots,g.n_columns,g.edgeSlot,pairs,columns);
+    else
+        runChains(g.bgl,P,g.n_vertices,g.n_slots,g.n_columns,g.edgeSlot,pairs,columns);
+    DEBUG_MSG("");
+}
+
+/*
+Write root and edge probabilities (indexed like the chain counts) in the
+output file format
+*/
+void writeProbabilities(std::ostream& outputf,
+    const graph_t& g,
+    const std::vector<double>& prob)
+{
+    for (int i=0;i<g.n_vertices;i++)
+    {
+    	outputf<<prob[i];
+    	outputf<<" ";
+        DEBUG_MSG("Node "<<i<<" : " << prob[i]);
+    }
+    outputf<<"\n";
+    for(size_t j=0;j<g.inputSlot.size();j++)
+    {
+    	DEBUG_MSG("Edge "<<j<<" : "<<prob[g.n_vertices+g.inputSlot[j]]);
+    	outputf<<prob[g.n_vertices+g.inputSlot[j]];
+    	outputf<<" ";
+    }
+}
+
+/*
+Write the root and edge probabilities estimated by the chains
+*/
+void writeResult(std::ostream& outputf,
+    const graph_t& g,
+    const std::vector<chain_t>& chains)
+{
+    //Pool the counts of all chains
+    double n_samples = 0;
+    std::vector<double> counts (chains[0].count.size());
+    for(size_t k=0;k<chains.size();k++)
+    {
+        n_samples += chains[k].n;
+        for(size_t q=0;q<counts.size();q++)
+            counts[q] += chains[k].count[q];
+    }
+
+    //Normalize root and edge probabilities
+    for(size_t q=0;q<counts.size();q++)
+        counts[q] /= n_samples;
+    writeProbabilities(outputf,g,counts);
+}
+
+/*
+Trees sampled under earlier weights: the input edges (with the weights used
+for sampling) and the parent of every vertex of every tree
+*/
+struct bank_t
+{
+    int weighted;
+    std::vector<boost::tuple<int,int,double> > edges;
+    std::vector<int> parents;
+};
+
+/*
+Read all edges of the input file
+*/
+void readEdges(std::string fileIN,std::vector<boost::tuple<int,int,double> >* edges)
+{
+    int v1,v2;
+    double wt;
+    std::string line;
+    std::ifstream inputf (fileIN.c_str());
+    getline(inputf,line);
+    while(readEdge(inputf,&v1,&v2,&wt))
+        edges->push_back(boost::make_tuple(v1,v2,wt));
+}
+
+bool readBank(std::string fileBANK,int n_vertices,bank_t* bank)
+{
+    std::ifstream bankf (fileBANK.c_str(),std::ios::binary);
+    char magic[8];
+    int n, n_edges;
+    long long n_trees;
+    if(!bankf.read(magic,8) || std::string(magic,8)!="MSTBANK1")
+        return false;
+    bankf.read((char*)&n,sizeof(n));
+    bankf.read((char*)&bank->weighted,sizeof(bank->weighted));
+    bankf.read((char*)&n_edges,sizeof(n_edges));
+    if(!bankf || n!=n_vertices || n_edges<0)
+        return false;
+    bank->edges.resize(n_edges);
+    for(int j=0;j<n_edges;j++)
+    {
+        int v1,v2;
+        double wt;
+        bankf.read((char*)&v1,sizeof(v1));
+        bankf.read((char*)&v2,sizeof(v2));
+        bankf.read((char*)&wt,sizeof(wt));
+        bank->edges[j] = boost::make_tuple(v1,v2,wt);
+    }
+    bankf.read((char*)&n_trees,sizeof(n_trees));
+    if(!bankf || n_trees<1)
+        return false;
+    bank->parents.resize(n_trees*n_vertices);
+    bankf.read((char*)&bank->parents[0],bank->parents.size()*sizeof(int));
+    return (bool)bankf;
+}
+
+void writeBank(std::string fileBANK,int n_vertices,const bank_t& bank)
+{
+    std::ofstream bankf (fileBANK.c_str(),std::ios::binary);
+    int n_edges = bank.edges.size();
+    long long n_trees = bank.parents.size()/n_vertices;
+    bankf.write("MSTBANK1",8);
+    bankf.write((const char*)&n_vertices,sizeof(n_vertices));
+    bankf.write((const char*)&bank.weighted,sizeof(bank.weighted));
+    bankf.write((const char*)&n_edges,sizeof(n_edges));
+    for(int j=0;j<n_edges;j++)
+    {
+        int v1 = boost::get<0>(bank.edges[j]), v2 = boost::get<1>(bank.edges[j]);
+        double wt = boost::get<2>(bank.edges[j]);
+        bankf.write((const char*)&v1,sizeof(v1));
+        bankf.write((const char*)&v2,sizeof(v2));
+        bankf.write((const char*)&wt,sizeof(wt));
+    }
+    bankf.write((const char*)&n_trees,sizeof(n_trees));
+    bankf.write((const char*)&bank.parents[0],bank.parents.size()*sizeof(int));
+}
+
+/*
+Slot of the edge u->t (original ids), -1 if it is not in the graph
+*/
+int findSlot(const graph_t& g,const std::vector<int>& newId,int u,int t)
+{
+    if(g.engine=="bgl")
+    {
+        unordered_map::const_iterator it = g.edgeSlot.find(getKey(u,t));
+        return it==g.edgeSlot.end() ? -1 : it->second;
+    }
+    const csr_digraph_t& c = g.csr;
+    u = newId[u];
+    t = newId[t];
+    std::vector<int>::const_iterator r = std::lower_bound(
+        c.target.begin()+c.rowStart[u],c.target.begin()+c.rowStart[u+1],t);
+    return (r!=c.target.begin()+c.rowStart[u+1] && *r==t) ? r-c.target.begin() : -1;
+}
+
+/*
+Self-normalized importance estimates of the root and edge probabilities
+under the weights of edges from the trees of the bank. A tree is reweighted
+by the ratio of the products of its walk weights under the new and old
+weights; since the root is uniform under both, weights are normalized per
+root. Returns the effective sample size; worst receives the smallest ratio
+of the ESS of a root to its number of trees, 0 if a root has fewer than
+MIN_ROOT_TREES trees (its estimates would ignore the new weights).
+*/
+const int MIN_ROOT_TREES = 20;
+double reweightBank(const graph_t& g,
+    const bank_t& bank,
+    int weighted,
+    const std::vector<boost::tuple<int,int,double> >& edges,
+    std::vector<double>* prob,
+    double* worst)
+{
+    int n_vertices = g.n_vertices;
+    std::vector<int> newId;
+    if(g.engine!="bgl")
+    {
+        newId.resize(n_vertices);
+        for(int v=0;v<n_vertices;v++)
+            newId[g.csr.label[v]] = v;
+    }
+    //Walk weight of every slot (summed over duplicate edges)
+    std::vector<double> oldW (g.n_slots,0), newW (g.n_slots,0);
+    for(size_t j=0;j<edges.size();j++)
+    {
+        oldW[g.inputSlot[j]] += bank.weighted==1 ? 100/boost::get<2>(bank.edges[j]) : 1;
+        newW[g.inputSlot[j]] += weighted==1 ? 100/boost::get<2>(edges[j]) : 1;
+    }
+    size_t n_trees = bank.parents.size()/n_vertices;
+    std::vector<double> logw (n_trees,0);
+    std::vector<int> rootOf (n_trees,-1);
+    for(size_t t=0;t<n_trees;t++)
+    {
+        const int* parent = &bank.parents[t*n_vertices];
+        for(int v=0;v<n_vertices;v++)
+        {
+            if(parent[v]<0)
+            {
+                rootOf[t] = v;
+                continue;
+            }
+            int s = findSlot(g,newId,v,parent[v]);
+            if(s<0)
+                throw std::out_of_range("edge "+getKey(v,parent[v])+" of a banked tree not in graph");
+            logw[t] += std::log(newW[s])-std::log(oldW[s]);
+        }
+    }
+    //Normalize within every root
+    std::vector<double> maxw (n_vertices,-std::numeric_limits<double>::infinity());
+    std::vector<double> sumw (n_vertices,0), sumsqw (n_vertices,0);
+    std::vector<int> rootTrees (n_vertices,0);
+    for(size_t t=0;t<n_trees;t++)
+        maxw[rootOf[t]] = std::max(maxw[rootOf[t]],logw[t]);
+    for(size_t t=0;t<n_trees;t++)
+    {
+        double w = std::exp(logw[t]-maxw[rootOf[t]]);
+        sumw[rootOf[t]] += w;
+        sumsqw[rootOf[t]] += w*w;
+        rootTrees[rootOf[t]]++;
+    }
+    *worst = std::numeric_limits<double>::infinity();
+    for(int r=0;r<n_vertices;r++)
+    {
+        if(rootTrees[r]<MIN_ROOT_TREES)
+            *worst = 0;
+        else
+            *worst = std::min(*worst,sumw[r]*sumw[r]/sumsqw[r]/rootTrees[r]);
+    }
+    double total = 0, sumsq = 0;
+    for(size_t t=0;t<n_trees;t++)
+    {
+        logw[t] = std::exp(logw[t]-maxw[rootOf[t]])/sumw[rootOf[t]];
+        total += logw[t];
+    }
+    prob->assign(n_vertices+g.n_slots,0);
+    for(size_t t=0;t<n_trees;t++)
+    {
+        double w = logw[t]/total;
+        sumsq += w*w;
+        const int* parent = &bank.parents[t*n_vertices];
+        (*prob)[rootOf[t]] += w;
+        for(int v=0;v<n_vertices;v++)
+        {
+            if(parent[v]<0)
+                continue;
+            int s = findSlot(g,newId,parent[v],v);
+            if(s<0)
+                throw std::out_of_range("edge "+getKey(parent[v],v)+" of a banked tree not in graph");
+            (*prob)[n_vertices+s] += w;
+        }
+    }
+    return 1/sumsq;
+}
+
+/*
+Write the per root and per edge diagnostics in input order, one section per
+weight column
+*/
+void writeDiagnostics(std::string fileDIAG,
+    const graph_t& g,
+    const std::vector<std::vector<chain_t> >& columns)
+{
+    std::ofstream diagf (fileDIAG.c_str());
+    for(size_t col=0;col<columns.size();col++)
+    {
+    const std::vector<chain_t>& chains = columns[col];
+    if(columns.size()>1)
+        diagf<<"# column "<<col<<"\n";
+    diagf<<"# chains="<<chains.size()<<" iterations="<<chains[0].n
+         <<" batch="<<chains[0].batchSize<<"\n";
+    diagf<<"# kind index mean mcse ess rhat\n";
+    for(int i=0;i<g.n_vertices;i++)
+    {
+        diag_t d = diagnose(chains,i);
+        diagf<<"root "<<i<<" "<<d.mean<<" "<<d.mcse<<" "<<d.ess<<" "<<d.rhat<<"\n";
+    }
+    for(size_t j=0;j<g.inputSlot.size();j++)
+    {
+        diag_t d = diagnose(chains,g.n_vertices+g.inputSlot[j]);
+        diagf<<"edge "<<j<<" "<<d.mean<<" "<<d.mcse<<" "<<d.ess<<" "<<d.rhat<<"\n";
+    }
+    }
+}
+
+/*
+Configure the pair accumulator of every chain within P.PAIRMEM: the subset
+of input edges listed in P.PAIRS (rank and rankSlot receive the rank of
+every slot and the slot of every rank), or a sketch of all pairs
+*/
+void preparePairs(const params_t& P,
+    const graph_t& g,
+    std::vector<int>* rank,
+    std::vector<int>* rankSlot,
+    pairs_t* pairs)
+{
+    double budget = P.PAIRMEM*1048576.0/(P.CHAINS*g.n_columns);
+    if(P.PAIRS=="all")
+    {
+        //Roughly 100 bytes per heavy pair in the map and the ordered set
+        pairs->mode = 2;
+        pairs->n_keys = g.n_slots;
+        pairs->depth = 4;
+        pairs->heavy = P.HEAVY;
+        double width = (budget-100.0*P.HEAVY)/(pairs->depth*sizeof(unsigned));
+        if(width<1024)
+            throw std::runtime_error("PAIRMEM too small for the pair sketch");
+        pairs->width = (size_t)width;
+        return;
+    }
+    std::ifstream in (P.PAIRS.c_str());
+    if(!in.is_open())
+        throw std::runtime_error("cannot read pairs file "+P.PAIRS);
+    rank->assign(g.n_slots,-1);
+    rankSlot->clear();
+    std::string word;
+    while(in>>word)
+    {
+        std::replace(word.begin(),word.end(),',',' ');
+        std::istringstream fields (word);
+        long long j;
+        while(fields>>j)
+        {
+            if(j<0 || j>=(long long)g.inputSlot.size())
+                throw std::out_of_range("pairs file edge "+std::to_string(j)+" not in [0,E-1]");
+            //Duplicate input edges share their slot
+            int slot = g.inputSlot[j];
+            if((*rank)[slot]<0)
+            {
+                (*rank)[slot] = rankSlot->size();
+                rankSlot->push_back(slot);
+            }
+        }
+    }
+    pairs->mode = 1;
+    pairs->rank = rank;
+    pairs->rankSlot = rankSlot;
+    pairs->n_keys = rankSlot->size();
+    //Roughly 32 bytes per entry of the sparse map if every pair occurs
+    if(pairs->n_keys*(pairs->n_keys-1)/2*32.0>budget)
+        throw std::runtime_error("PAIRMEM too small for "+std::to_string(pairs->n_keys)
+                                 +" selected edges, select fewer or use PAIRS=all");
+}
+
+/*
+Merge the pair accumulators of the chains and write the co-occurrence
+probabilities of input edge pairs "i j p", one section per weight column.
+Subsets give every pair seen in some tree (i<j); the sketch gives the heavy
+pairs with the largest estimates, capped by the frequency of either edge,
+which overestimate by at most the reported error with probability
+1-exp(-depth).
+*/
+void writePairs(std::string filePAIRS,
+    const graph_t& g,
+    const std::vector<std::vector<chain_t> >& columns)
+{
+    //Input edges of every slot
+    std::vector<std::pair<int,int> > slotInput;
+    for(size_t j=0;j<g.inputSlot.size();j++)
+        slotInput.push_back(std::make_pair(g.inputSlot[j],(int)j));
+    std::sort(slotInput.begin(),slotInput.end());
+    std::ofstream pairsf (filePAIRS.c_str());
+    for(size_t col=0;col<columns.size();col++)
+    {
+        const std::vector<chain_t>& chains = columns[col];
+        const pairs_t& first = chains[0].pairs;
+        double n_samples = 0;
+        for(size_t k=0;k<chains.size();k++)
+            n_samples += chains[k].n;
+        if(columns.size()>1)
+            pairsf<<"# column "<<col<<"\n";
+        //Slot pairs with their merged counts
+        std::vector<std::pair<long long,double> > merged;
+        if(first.mode==1)
+        {
+            boost::unordered_map<long long,double> counts;
+            for(size_t k=0;k<chains.size();k++)
+                for(boost::unordered_map<long long,unsigned>::const_iterator it=chains[k].pairs.counts.begin();
+                    it!=chains[k].pairs.counts.end();++it)
+                    counts[it->first] += it->second;
+            for(boost::unordered_map<long long,double>::iterator it=counts.begin();it!=counts.end();++it)
+            {
+                long long a = (*first.rankSlot)[it->first/first.n_keys];
+                long long b = (*first.rankSlot)[it->first%first.n_keys];
+                merged.push_back(std::make_pair(a*g.n_slots+b,it->second));
+            }
+        }
+        else
+        {
+            pairs_t sum = first;
+            std::set<long long> candidates;
+            for(size_t k=0;k<chains.size();k++)
+            {
+                const pairs_t& p = chains[k].pairs;
+                if(k>0)
+                {
+                    for(size_t c=0;c<sum.sketch.size();c++)
+                        sum.sketch[c] += p.sketch[c];
+                    sum.total += p.total;
+                }
+                for(boost::unordered_map<long long,unsigned>::const_iterator it=p.topCount.begin();
+                    it!=p.topCount.end();++it)
+                    candidates.insert(it->first);
+            }
+            //A pair cannot occur in more trees than either of its edges
+            std::vector<double> slotCount (g.n_slots,0);
+            for(size_t k=0;k<chains.size();k++)
+                for(int j=0;j<g.n_slots;j++)
+                    slotCount[j] += chains[k].count[g.n_vertices+j];
+            std::vector<std::pair<double,long long> > ranked;
+            for(std::set<long long>::iterator it=candidates.begin();it!=candidates.end();++it)
+            {
+                double est = std::min((double)sketchEstimate(sum,*it),
+                    std::min(slotCount[*it/sum.n_keys],slotCount[*it%sum.n_keys]));
+                if(est>0)
+                    ranked.push_back(std::make_pair(est,*it));
+            }
+            std::sort(ranked.rbegin(),ranked.rend());
+            for(size_t r=0;r<ranked.size() && r<sum.heavy;r++)
+                merged.push_back(std::make_pair(ranked[r].second,ranked[r].first));
+            pairsf<<"# count-min sketch depth="<<sum.depth<<" width="<<sum.width
+                  <<" error="<<std::exp(1.0)*sum.total/sum.width/n_samples<<"\n";
+        }
+        pairsf<<"# edge_i edge_j probability\n";
+        //Subset pairs in input order, sketch pairs by decreasing count
+        std::vector<boost::tuple<double,int,int,double> > rows;
+        for(size_t m=0;m<merged.size();m++)
+        {
+            int a = merged[m].first/g.n_slots, b = merged[m].first%g.n_slots;
+            double order = first.mode==1 ? 0 : -merged[m].second;
+            std::vector<std::pair<int,int> >::iterator ia, ib;
+            for(ia=std::lower_bound(slotInput.begin(),slotInput.end(),std::make_pair(a,-1));
+                ia!=slotInput.end() && ia->first==a;++ia)
+                for(ib=std::lower_bound(slotInput.begin(),slotInput.end(),std::make_pair(b,-1));
+                    ib!=slotInput.end() && ib->first==b;++ib)
+                    rows.push_back(boost::make_tuple(order,std::min(ia->second,ib->second),
+                                   std::max(ia->second,ib->second),merged[m].second/n_samples));
+        }
+        std::sort(rows.begin(),rows.end());
+        for(size_t r=0;r<rows.size();r++)
+            pairsf<<boost::get<1>(rows[r])<<" "<<boost::get<2>(rows[r])<<" "<<boost::get<3>(rows[r])<<"\n";
+    }
+}
+
+int MCMC_spanning_tree(std::string fileIN,std::string fileOUT,params_t P)
+{
+	//Read graph structure from fileIN
+	std::ifstream inputf (fileIN.c_str());
+	if(!inputf.is_open())
+	{
+		std::cerr<<"Input file not found. Cannot be opened\n";
+		return EXIT_FAILURE;
+	}
+	graph_t g;
+	try
+	{
+		if(!loadGraph(inputf,P,&g))
+		{
+			std::cerr<<"Input file has no vertex count\n";
+			return EXIT_FAILURE;
+		}
+	}
+	catch(std::exception& e)
+	{
+		std::cerr<<"Invalid input file: "<<e.what()<<"\n";
+		return EXIT_FAILURE;
+	}
+	inputf.close();
+
+    bank_t bank;
+    if(!P.BANK.empty())
+    {
+        //Reuse the banked trees if they still represent the new weights
+        std::vector<boost::tuple<int,int,double> > edges;
+        readEdges(fileIN,&edges);
+        bool sameGraph = readBank(P.BANK,g.n_vertices,&bank) && bank.edges.size()==edges.size();
+        for(size_t j=0;sameGraph && j<edges.size();j++)
+            sameGraph = boost::get<0>(edges[j])==boost::get<0>(bank.edges[j])
+                     && boost::get<1>(edges[j])==boost::get<1>(bank.edges[j]);
+        if(sameGraph)
+        {
+            std::vector<double> prob;
+            size_t n_trees = bank.parents.size()/g.n_vertices;
+            double worst;
+            double ess = reweightBank(g,bank,P.WEIGHTED,edges,&prob,&worst);
+            std::cout<<"[bank] "<<n_trees<<" trees, ESS="<<ess<<" worst root ESS/trees="<<worst<<std::endl;
+            //Every root must be represented well enough on its own
+            if(worst>0 && worst>=P.MINESS)
+            {
+                std::ofstream outputf (fileOUT.c_str());
+                writeProbabilities(outputf,g,prob);
+                return EXIT_SUCCESS;
+            }
+            if(worst==0)
+                std::cout<<"[bank] a root has fewer than "<<MIN_ROOT_TREES<<" trees, sampling new trees"<<std::endl;
+            else
+                std::cout<<"[bank] root ESS below "<<P.MINESS<<" of its trees, sampling new trees"<<std::endl;
+        }
+        else
+            std::cout<<"[bank] no bank for this graph in "<<P.BANK<<", sampling new trees"<<std::endl;
+        bank.weighted = P.WEIGHTED;
+        bank.edges.swap(edges);
+    }
+
+    //Pair accumulator copied into every chain
+    pairs_t pairs;
+    std::vector<int> pairRank, pairSlot;
+    if(!P.PAIRS.empty())
+    {
+        try
+        {
+            preparePairs(P,g,&pairRank,&pairSlot,&pairs);
+        }
+        catch(std::exception& e)
+        {
+            std::cerr<<"Invalid pairs: "<<e.what()<<"\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::vector<chain_t> > columns;
+    try
+    {
+        runTest(g,P,pairs,&columns);
+    }
+    catch(std::exception& e)
+    {
+        std::cerr<<"Sampling failed: "<<e.what()<<"\n";
+        return EXIT_FAILURE;
+    }
+    DEBUG_MSG("---RESULT---");
+    
+    //One root line and one edge line per weight column
+    std::ofstream outputf (fileOUT.c_str());
+    for(size_t col=0;col<columns.size();col++)
+    {
+        if(col>0)
+            outputf<<"\n";
+        writeResult(outputf,g,columns[col]);
+    }
+
+    if(P.DIAG.empty() && P.CHAINS>1)
+        P.DIAG = fileOUT+".diag";
+    if(!P.DIAG.empty())
+        writeDiagnostics(P.DIAG,g,columns);
+    if(!P.PAIRS.empty())
+        writePairs(fileOUT+".pairs",g,columns);
+
+    if(!P.BANK.empty())
+    {
+        const std::vector<chain_t>& chains = columns[0];
+        bank.parents.clear();
+        for(size_t k=0;k<chains.size();k++)
+            bank.parents.insert(bank.parents.end(),chains[k].trees.begin(),chains[k].trees.end());
+        writeBank(P.BANK,g.n_vertices,bank);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+Set a named parameter given as NAME=VALUE
+*/
+bool setParameter(params_t* P,std::string arg,bool verbose)
+{
+	size_t eq = arg.find('=');
+	if(eq==std::string::npos)
+		return false;
+	std::string name = arg.substr(0,eq);
+	std::string value = arg.substr(eq+1);
+	if(name=="WEIGHTED")
+	{
+		P->WEIGHTED = atoi(value.c_str());
+		if(P->WEIGHTED!=0 && P->WEIGHTED!=1)
+			return false;
+	}
+	else if(name=="MAXITS")
+	{
+		P->MAXITS = atoi(value.c_str());
+		if(P->MAXITS<1)
+			return false;
+	}
+	else if(name=="CHAINS")
+	{
+		P->CHAINS = atoi(value.c_str());
+		if(P->CHAINS<1)
+			return false;
+	}
+	else if(name=="SEED")
+		P->SEED = strtoul(value.c_str(),NULL,10);
+	else if(name=="REPORT")
+		P->REPORT = atoi(value.c_str());
+	else if(name=="DIAG")
+		P->DIAG = value;
+	else if(name=="ENGINE")
+	{
+		P->ENGINE = value;
+		if(P->ENGINE!="bgl" && P->ENGINE!="csr" && P->ENGINE!="parallel")
+			return false;
+	}
+	else if(name=="THREADS")
+	{
+		P->THREADS = atoi(value.c_str());
+		if(P->THREADS<0)
+			return false;
+	}
+	else if(name=="REORDER")
+	{
+		P->REORDER = value;
+		if(P->REORDER!="none" && P->REORDER!="bfs" && P->REORDER!="rcm" && P->REORDER!="degree")
+			return false;
+	}
+	else if(name=="TIMING")
+		P->TIMING = atoi(value.c_str());
+	else if(name=="WEIGHTS")
+		P->WEIGHTS = value;
+	else if(name=="PAIRS")
+		P->PAIRS = value;
+	else if(name=="PAIRMEM")
+	{
+		P->PAIRMEM = atoi(value.c_str());
+		if(P->PAIRMEM<1)
+			return false;
+	}
+	else if(name=="HEAVY")
+	{
+		P->HEAVY = atoi(value.c_str());
+		if(P->HEAVY<1)
+			return false;
+	}
+	else if(name=="BANK")
+		P->BANK = value;
+	else if(name=="MINESS")
+	{
+		P->MINESS = atof(value.c_str());
+		if(P->MINESS<0 || P->MINESS>1)
+			return false;
+	}
+	else
+		return false;
+	if(verbose)
+		std::cout<<"Modifying "<<name<<" to "<<value<<std::endl;
+	return true;
+}
+
+/*
+Parameters that only make sense together
+*/
+void fixParameters(params_t* P,bool verbose)
+{
+	if(!P->WEIGHTS.empty() && P->WEIGHTED!=1)
+	{
+		P->WEIGHTED = 1;
+		if(verbose)
+			std::cout<<"Modifying WEIGHTED to 1 (needed by WEIGHTS)"<<std::endl;
+	}
+	if(!P->WEIGHTS.empty() && P->ENGINE=="bgl")
+	{
+		P->ENGINE = "csr";
+		if(verbose)
+			std::cout<<"Modifying ENGINE to csr (needed by WEIGHTS)"<<std::endl;
+	}
+	if(P->REORDER!="none" && P->ENGINE=="bgl")
+	{
+		P->ENGINE = "csr";
+		if(verbose)
+			std::cout<<"Modifying ENGINE to csr (needed by REORDER)"<<std::endl;
+	}
+}
+
+/*
+Server mode: answer sampling requests on a Unix domain socket.
+
+Request (one or more per connection):
+    SAMPLE <NAME=VALUE>*\n
+    GRAPH <n bytes>\n<n bytes in the input file format>    or    HASH <hash>\n
+Response:
+    OK <hash>\n<root probabilities>\n<edge probabilities>\n    or    ERROR <message>\n
+
+Built graphs are cached by content hash (and engine/reordering), a
+client may send HASH <hash> instead of the graph to reuse it.
+
+Every connection has its own reader thread, which parses requests and
+queues them to the WORKERS sampling threads, so an idle connection holds
+no worker. Connections silent for IDLE seconds are closed and at most
+CONNECTIONS are open at once.
+*/
+int WORKERS = 4;
+size_t CACHE = 16;
+int IDLE = 300;
+int CONNECTIONS = 64;
+
+/*
+Buffered reads and writes on a connected socket
+*/
+struct connection_t
+{
+    int fd;
+    std::string buf;
+    size_t pos;
+
+    connection_t(int fd) : fd(fd), pos(0) {}
+
+    bool fill()
+    {
+        char tmp[65536];
+        ssize_t r = ::read(fd,tmp,sizeof(tmp));
+        if(r<=0)
+            return false;
+        buf.erase(0,pos);
+        pos = 0;
+        buf.append(tmp,r);
+        return true;
+    }
+    bool readLine(std::string* line)
+    {
+        size_t nl;
+        while((nl=buf.find('\n',pos))==std::string::npos)
+            if(!fill())
+                return false;
+        line->assign(buf,pos,nl-pos);
+        pos = nl+1;
+        return true;
+    }
+    bool readBytes(size_t n,std::string* out)
+    {
+        while(buf.size()-pos<n)
+            if(!fill())
+                return false;
+        out->assign(buf,pos,n);
+        pos += n;
+        return true;
+    }
+    bool writeAll(const std::string& s)
+    {
+        size_t done = 0;
+        while(done<s.size())
+        {
+            ssize_t w = ::write(fd,s.data()+done,s.size()-done);
+            if(w<=0)
+                return false;
+            done += w;
+        }
+        return true;
+    }
+};
+
+/*
+Least recently used cache of built graphs
+*/
+struct graph_cache_t
+{
+    std::mutex lock;
+    std::list<std::pair<std::string,std::shared_ptr<const graph_t> > > entries;
+
+    std::shared_ptr<const graph_t> find(const std::string& key)
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        for(auto it=entries.begin();it!=entries.end();++it)
+        {
+            if(it->first==key)
+            {
+                entries.splice(entries.begin(),entries,it);
+                return it->second;
+            }
+        }
+        return std::shared_ptr<const graph_t>();
+    }
+    void insert(const std::string& key,std::shared_ptr<const graph_t> g)
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        entries.push_front(std::make_pair(key,g));
+        while(entries.size()>CACHE)
+            entries.pop_back();
+    }
+};
+
+/*
+64 bit FNV-1a hash of the graph text, in hex
+*/
+std::string contentHash(const std::string& text)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for(size_t i=0;i<text.size();i++)
+    {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    char hex[17];
+    snprintf(hex,sizeof(hex),"%016llx",h);
+    return std::string(hex);
+}
+
+/*
+Parsed request waiting for a worker, and the response its reader sends
+*/
+struct request_t
+{
+    params_t P;
+    //Graph text if sent, else the hash of a cached graph
+    bool sent;
+    std::string text;
+    std::string hash;
+    std::promise<std::string> response;
+};
+
+/*
+State shared by the reader threads and the workers of the server
+*/
+struct server_t
+{
+    graph_cache_t cache;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::queue<std::shared_ptr<request_t> > pending;
+    //Connections with a reader thread
+    int connections = 0;
+};
+
+/*
+Sample one request and format its response
+*/
+std::string answerRequest(request_t* r,graph_cache_t* cache)
+{
+    std::string hash = r->sent ? contentHash(r->text) : r->hash;
+    std::string key = hash+" "+r->P.ENGINE+" "+r->P.REORDER;
+    std::shared_ptr<const graph_t> g = cache->find(key);
+    if(!g && !r->sent)
+        return "ERROR unknown graph "+hash+"\n";
+    if(!g)
+    {
+        std::istringstream in (r->text);
+        std::shared_ptr<graph_t> built (new graph_t);
+        try
+        {
+            if(!loadGraph(in,r->P,built.get()))
+                return "ERROR graph has no vertex count\n";
+        }
+        catch(std::exception& e)
+        {
+            return std::string("ERROR ")+e.what()+"\n";
+        }
+        g = built;
+        cache->insert(key,g);
+    }
+    std::vector<std::vector<chain_t> > columns;
+    try
+    {
+        runTest(*g,r->P,pairs_t(),&columns);
+    }
+    catch(std::exception& e)
+    {
+        return std::string("ERROR ")+e.what()+"\n";
+    }
+    std::ostringstream response;
+    response<<"OK "<<hash<<"\n";
+    writeResult(response,*g,columns[0]);
+    response<<"\n";
+    return response.str();
+}
+
+/*
+Read the requests of one connection, queue them to the workers and send
+their responses in order
+*/
+void readConnection(int fd,server_t* server)
+{
+    connection_t conn (fd);
+    std::string line;
+    while(conn.readLine(&line))
+    {
+        if(line.empty())
+            continue;
+        std::istringstream request (line);
+        std::string word;
+        request>>word;
+        if(word!="SAMPLE")
+        {
+            conn.writeAll("ERROR expected SAMPLE\n");
+            break;
+        }
+        std::shared_ptr<request_t> r (new request_t);
+        r->P = PARAMS;
+        r->P.progress = false;
+        r->P.DIAG = "";
+        r->P.BANK = "";
+        std::string bad;
+        while(request>>word)
+        {
+            if(bad.empty() && (word.compare(0,5,"DIAG=")==0 || word.compare(0,5,"BANK=")==0
+               || word.compare(0,8,"WEIGHTS=")==0 || word.compare(0,6,"PAIRS=")==0
+               || !setParameter(&r->P,word,false)))
+                bad = word;
+        }
+        fixParameters(&r->P,false);
+        if(!conn.readLine(&line))
+            break;
+        //Read the graph even for a rejected request, to stay in step with the client
+        r->sent = line.compare(0,6,"GRAPH ")==0;
+        if(r->sent && !conn.readBytes(strtoul(line.c_str()+6,NULL,10),&r->text))
+            break;
+        if(!r->sent && line.compare(0,5,"HASH ")!=0)
+        {
+            conn.writeAll("ERROR expected GRAPH or HASH\n");
+            break;
+        }
+        if(!bad.empty())
+        {
+            conn.writeAll("ERROR invalid parameter "+bad+"\n");
+            continue;
+        }
+        if(!r->sent)
+            r->hash = line.substr(5);
+        std::future<std::string> response = r->response.get_future();
+        {
+            std::lock_guard<std::mutex> guard (server->lock);
+            server->pending.push(r);
+            server->ready.notify_one();
+        }
+        if(!conn.writeAll(response.get()))
+            break;
+    }
+    close(fd);
+    std::lock_guard<std::mutex> guard (server->lock);
+    server->connections--;
+}
+
+int serve(std::string socketPath)
+{
+    int listener = socket(AF_UNIX,SOCK_STREAM,0);
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(listener<0 || socketPath.size()>=sizeof(addr.sun_path))
+    {
+        std::cerr<<"Cannot create socket "<<socketPath<<std::endl;
+        return EXIT_FAILURE;
+    }
+    strncpy(addr.sun_path,socketPath.c_str(),sizeof(addr.sun_path)-1);
+    unlink(socketPath.c_str());
+    if(bind(listener,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(listener,64)<0)
+    {
+        std::cerr<<"Cannot listen on "<<socketPath<<std::endl;
+        return EXIT_FAILURE;
+    }
+    //Clients that hang up must not kill the server
+    signal(SIGPIPE,SIG_IGN);
+    std::cout<<"Listening on "<<socketPath<<" with "<<WORKERS<<" workers"<<std::endl;
+
+    //Shared with detached reader threads, so never freed
+    server_t* server = new server_t;
+    std::vector<std::thread> pool;
+    for(int w=0;w<WORKERS;w++)
+    {
+        pool.push_back(std::thread([server]()
+        {
+            while(true)
+            {
+                std::shared_ptr<request_t> r;
+                {
+                    std::unique_lock<std::mutex> guard (server->lock);
+                    while(server->pending.empty())
+                        server->ready.wait(guard);
+                    r = server->pending.front();
+                    server->pending.pop();
+                }
+                std::string response;
+                try
+                {
+                    response = answerRequest(r.get(),&server->cache);
+                }
+                catch(std::exception& e)
+                {
+                    response = std::string("ERROR ")+e.what()+"\n";
+                }
+                r->response.set_value(response);
+            }
+        }));
+    }
+    struct timeval idle;
+    idle.tv_sec = IDLE;
+    idle.tv_usec = 0;
+    while(true)
+    {
+        int fd = accept(listener,NULL,NULL);
+        if(fd<0)
+            continue;
+        {
+            std::lock_guard<std::mutex> guard (server->lock);
+            if(server->connections<CONNECTIONS)
+                server->connections++;
+            else
+            {
+                connection_t(fd).writeAll("ERROR too many connections\n");
+                close(fd);
+                continue;
+            }
+        }
+        //Reads of an idle connection fail after IDLE seconds
+        setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&idle,sizeof(idle));
+        std::thread(readConnection,fd,server).detach();
+    }
+    return EXIT_SUCCESS;
+}
+
+std::string PNAME = "MCMC_spanning_tree";
+int main(int argc,char* argv[])
+{
+	if (argc < 3)
+	{
 		std::cerr << "Usage (* indicates optional): " << PNAME
-			 << " <input file name> <output file name> <Weighted=0>* <MAXIT=10K>*\n";
+			 << " <input file name> <output file name> <Weighted=0>* <MAXIT=10K>* <NAME=VALUE>*\n"
+			 << "       " << PNAME << " --serve <socket path> <WORKERS=4>* <CACHE=16>* <IDLE=300>* <CONNECTIONS=64>* <NAME=VALUE>*\n"
+			 << "  CHAINS=1   number of independent chains\n"
+			 << "  SEED=5489  seed of the first chain\n"
+			 << "  REPORT=0   print diagnostics every REPORT iterations\n"
+			 << "  DIAG=file  diagnostics output (default <output file>.diag if CHAINS>1)\n"
+			 << "  ENGINE=bgl sampler, bgl, csr or parallel (csr graph, one tree built by THREADS threads)\n"
+			 << "  THREADS=0  threads per tree of the parallel engine (0 = all cores)\n"
+			 << "  REORDER=none  relabel vertices of the csr graph: none, bfs, rcm or degree\n"
+			 << "  TIMING=0   print sampling throughput and cache miss rate\n"
+			 << "  WEIGHTS=file  weight columns (one line per input edge), sampled together (csr graph)\n"
+			 << "  PAIRS=file write <output file>.pairs, co-occurrence of the listed input edges (or all: sketch)\n"
+			 << "  PAIRMEM=64 memory budget of the pair accumulators in MB\n"
+			 << "  HEAVY=100  number of pairs reported by PAIRS=all\n"
+			 << "  BANK=file  reuse trees sampled under earlier weights by importance reweighting\n"
+			 << "  MINESS=0.5 resample when the reweighted ESS of a root is below MINESS*(its banked trees)\n";
 		return EXIT_FAILURE;
 	}
+	if (std::string(argv[1])=="--serve")
+	{
+		//Remaining arguments are the server settings and default parameters
+		for (int a=3;a<argc;a++)
+		{
+			std::string arg (argv[a]);
+			if(arg.compare(0,8,"WORKERS=")==0 && atoi(arg.c_str()+8)>0)
+				WORKERS = atoi(arg.c_str()+8);
+			else if(arg.compare(0,6,"CACHE=")==0 && atoi(arg.c_str()+6)>0)
+				CACHE = atoi(arg.c_str()+6);
+			else if(arg.compare(0,5,"IDLE=")==0 && atoi(arg.c_str()+5)>0)
+				IDLE = atoi(arg.c_str()+5);
+			else if(arg.compare(0,12,"CONNECTIONS=")==0 && atoi(arg.c_str()+12)>0)
+				CONNECTIONS = atoi(arg.c_str()+12);
+			else if(arg.compare(0,8,"WEIGHTS=")==0 || arg.compare(0,6,"PAIRS=")==0)
+			{
+				std::cerr <<"WEIGHTS and PAIRS are not supported by the server"<<std::endl;
+				return EXIT_FAILURE;
+			}
+			else if(!setParameter(&PARAMS,arg,true))
+			{
+				std::cerr <<"Invalid parameter "<<arg<<std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		fixParameters(&PARAMS,true);
+		return serve(argv[2]);
+	}
 	//Modify global constants if specified
 	if (argc>=4)
 	{
-		WEIGHTED = atoi(argv[3]);
-		std::cout<<"Modifying WEIGHTED to "<<WEIGHTED<<std::endl;
-		if(WEIGHTED!=0 && WEIGHTED!=1)
+		PARAMS.WEIGHTED = atoi(argv[3]);
+		std::cout<<"Modifying WEIGHTED to "<<PARAMS.WEIGHTED<<std::endl;
+		if(PARAMS.WEIGHTED!=0 && PARAMS.WEIGHTED!=1)
 		{
 			std::cerr <<"WEIGHTED must be 1/0"<<std::endl;
 			return EXIT_FAILURE;
 		}
 	}
-	if (argc==5)
+	if (argc>=5)
+	{
+		PARAMS.MAXITS = atoi(argv[4]);
+		std::cout<<"Modifying MAXITS to "<<PARAMS.MAXITS<<std::endl;
+	}
+	for (int a=5;a<argc;a++)
 	{
-		MAXITS = atoi(argv[4]);
-		std::cout<<"Modifying MAXITS to "<<MAXITS<<std::endl;
+		if(!setParameter(&PARAMS,argv[a],true))
+		{
+			std::cerr <<"Invalid parameter "<<argv[a]<<std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	fixParameters(&PARAMS,true);
+	if(!PARAMS.BANK.empty() && (!PARAMS.WEIGHTS.empty() || !PARAMS.PAIRS.empty()))
+	{
+		std::cerr <<"WEIGHTS and PAIRS cannot be combined with BANK"<<std::endl;
+		return EXIT_FAILURE;
 	}
 	DEBUG_MSG("---Calling <MCMC_spanning_tree>---\nINPUT FILE: "<<argv[1]<<"\nOUTPUT FILE: "<<argv[2]);
-	return MCMC_spanning_tree(argv[1],argv[2]);
+	return MCMC_spanning_tree(argv[1],argv[2],PARAMS);
 	
 }
@@ -0,0 +1,86 @@
+/* Benchmark the effect of vertex reordering on the sampler
+ *
+ * Writes a grid graph whose vertex ids are scrambled by a hash (as in our
+ * real inputs) and runs MCMC_spanning_tree on it with every REORDER mode,
+ * and with the parallel engine, reporting throughput and (where perf
+ * counters are available) the cache miss rate of the sampling loop.
+ *
+ * Usage : ./spanning_tree_bench |Optional: SIDE (300)| |Optional: MAXITS (20)|
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+
+std::string SAMPLER = "./MCMC_spanning_tree";
+std::string GRAPH   = "bench_graph.tc";
+std::string RESULT  = "bench_output.txt";
+
+/*
+SIDE x SIDE grid (both directions of every edge) with randomly permuted ids
+*/
+void writeGrid(int side)
+{
+    int n_vertices = side*side;
+    std::vector<int> id (n_vertices);
+    for(int v=0;v<n_vertices;v++)
+        id[v] = v;
+    boost::random::mt19937 rng;
+    for(int v=n_vertices-1;v>0;v--)
+        std::swap(id[v],id[rng()%(v+1)]);
+    std::ofstream out (GRAPH.c_str());
+    out<<n_vertices<<"\n";
+    for(int r=0;r<side;r++)
+    {
+        for(int c=0;c<side;c++)
+        {
+            int v = r*side+c;
+            if(c+1<side)
+                out<<id[v]<<","<<id[v+1]<<",1\n"<<id[v+1]<<","<<id[v]<<",1\n";
+            if(r+1<side)
+                out<<id[v]<<","<<id[v+side]<<",1\n"<<id[v+side]<<","<<id[v]<<",1\n";
+        }
+    }
+}
+
+/*
+Run the sampler and return its [timing] line
+*/
+std::string run(std::string params,int maxits)
+{
+    std::string cmd = SAMPLER+" "+GRAPH+" "+RESULT+" 0 "+std::to_string((long long)maxits)
+                      +" TIMING=1 "+params;
+    FILE* p = popen(cmd.c_str(),"r");
+    if(p==NULL)
+        return "failed to run "+cmd;
+    std::string timing = "no timing reported";
+    char buf[4096];
+    while(fgets(buf,sizeof(buf),p)!=NULL)
+    {
+        std::string line (buf);
+        if(line.compare(0,8,"[timing]")==0)
+            timing = line.substr(0,line.size()-1);
+    }
+    pclose(p);
+    return timing;
+}
+
+int main(int argc,char* argv[])
+{
+    int side = argc>=2 ? atoi(argv[1]) : 300;
+    int maxits = argc>=3 ? atoi(argv[2]) : 20;
+    std::cout<<"----------- "<<side<<"x"<<side<<" grid, hashed ids, "<<maxits<<" trees ------------"<<std::endl;
+    writeGrid(side);
+    std::cout<<run("ENGINE=bgl",maxits)<<std::endl;
+    const char* modes[] = {"none","bfs","rcm","degree"};
+    for(int m=0;m<4;m++)
+        std::cout<<run(std::string("ENGINE=csr REORDER=")+modes[m],maxits)<<std::endl;
+    std::cout<<run("ENGINE=parallel REORDER=bfs",maxits)<<std::endl;
+    remove(GRAPH.c_str());
+    remove(RESULT.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,661 @@
+/* Statistical equivalence tests of the samplers against exact probabilities
+ *
+ * Every engine (and reordering), weighting mode, multiple chains, weight
+ * columns, edge pair counts and the reweighted tree bank are run through MCMC_spanning_tree with fixed seeds
+ * and their root and edge frequencies are compared with the exact values:
+ * brute force enumeration of all arborescences for tiny graphs and the
+ * matrix-tree theorem for larger ones. Roots get a chi-square test and
+ * edges and edge pairs a z-test, all Bonferroni corrected.
+ *
+ * Usage : ./spanning_tree_equivalence_test   (exits with EXIT_FAILURE on any failure)
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <boost/tuple/tuple.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+std::string SAMPLER = "./MCMC_spanning_tree";
+std::string GRAPH   = "equivalence_graph.tc";
+std::string RESULT  = "equivalence_output.txt";
+std::string BANK    = "equivalence_bank.bin";
+std::string WEIGHTS = "equivalence_weights.txt";
+std::string PAIRS   = "equivalence_pairs.txt";
+//Family-wise false failure rate of one sampler run
+double ALPHA = 1e-4;
+
+typedef std::vector<boost::tuple<int,int,double> > edge_list_t;
+typedef std::vector<std::vector<double> > matrix_t;
+int failures = 0;
+
+/*
+Walk weight of every ordered pair u->t, summed over duplicate edges (the
+samplers use 100/weight when weighted and 1 otherwise)
+*/
+matrix_t walkWeights(int n_vertices,const edge_list_t& edges,int weighted)
+{
+    matrix_t W (n_vertices,std::vector<double>(n_vertices,0));
+    for(size_t j=0;j<edges.size();j++)
+        W[boost::get<0>(edges[j])][boost::get<1>(edges[j])] +=
+            weighted ? 100/boost::get<2>(edges[j]) : 1;
+    return W;
+}
+
+/*
+P[u][t] = probability that t is the parent of u, the tree being drawn with
+a uniform root r and probability proportional to the product of W[u][parent(u)].
+If pairMass is given, pairMass[u*N+t][x*N+y] also collects the mass of the
+trees where t is the parent of u and y the parent of x.
+*/
+void enumerate(const matrix_t& W,int root,int v,std::vector<int>* parent,
+    double weight,matrix_t* mass,double* Z,matrix_t* pairMass)
+{
+    int n_vertices = W.size();
+    if(v==n_vertices)
+    {
+        //Accept if every vertex reaches the root
+        for(int u=0;u<n_vertices;u++)
+        {
+            int x = u, steps = 0;
+            while(x!=root && steps<=n_vertices)
+            {
+                x = (*parent)[x];
+                steps++;
+            }
+            if(x!=root)
+                return;
+        }
+        *Z += weight;
+        for(int u=0;u<n_vertices;u++)
+            if(u!=root)
+                (*mass)[u][(*parent)[u]] += weight;
+        for(int u=0;u<n_vertices && pairMass!=NULL;u++)
+            for(int x=0;x<n_vertices;x++)
+                if(u!=root && x!=root)
+                    (*pairMass)[u*n_vertices+(*parent)[u]][x*n_vertices+(*parent)[x]] += weight;
+        return;
+    }
+    if(v==root)
+    {
+        enumerate(W,root,v+1,parent,weight,mass,Z,pairMass);
+        return;
+    }
+    for(int t=0;t<n_vertices;t++)
+    {
+        if(t==v || W[v][t]==0)
+            continue;
+        (*parent)[v] = t;
+        enumerate(W,root,v+1,parent,weight*W[v][t],mass,Z,pairMass);
+    }
+}
+
+/*
+P[u][t] by enumeration; pairs (if given) receives the probability of every
+two parent relations, indexed like pairMass
+*/
+matrix_t bruteForce(const matrix_t& W,matrix_t* pairs=NULL)
+{
+    int n_vertices = W.size();
+    int n2 = n_vertices*n_vertices;
+    matrix_t P (n_vertices,std::vector<double>(n_vertices,0));
+    if(pairs!=NULL)
+        pairs->assign(n2,std::vector<double>(n2,0));
+    for(int r=0;r<n_vertices;r++)
+    {
+        matrix_t mass (n_vertices,std::vector<double>(n_vertices,0));
+        matrix_t pairMass (pairs!=NULL ? n2 : 0,std::vector<double>(n2,0));
+        std::vector<int> parent (n_vertices,-1);
+        double Z = 0;
+        enumerate(W,r,0,&parent,1,&mass,&Z,pairs!=NULL ? &pairMass : NULL);
+        for(int u=0;u<n_vertices;u++)
+            for(int t=0;t<n_vertices;t++)
+                P[u][t] += mass[u][t]/Z/n_vertices;
+        for(int a=0;a<n2 && pairs!=NULL;a++)
+            for(int b=0;b<n2;b++)
+                (*pairs)[a][b] += pairMass[a][b]/Z/n_vertices;
+    }
+    return P;
+}
+
+/*
+Same probabilities from the matrix-tree theorem: with M the Laplacian
+(out-degrees on the diagonal) without the row and column of the root and
+G its inverse, P(u->t | r) = W[u][t]*(G[u][u]-G[t][u]) (G[t][u]=0 for t=r)
+*/
+matrix_t matrixTree(const matrix_t& W)
+{
+    int n_vertices = W.size();
+    int m = n_vertices-1;
+    matrix_t P (n_vertices,std::vector<double>(n_vertices,0));
+    for(int r=0;r<n_vertices;r++)
+    {
+        //Index of vertex v in the reduced matrix
+        std::vector<int> idx (n_vertices,-1);
+        for(int v=0,i=0;v<n_vertices;v++)
+            if(v!=r)
+                idx[v] = i++;
+        matrix_t A (m,std::vector<double>(2*m,0));
+        for(int u=0;u<n_vertices;u++)
+        {
+            if(u==r)
+                continue;
+            for(int t=0;t<n_vertices;t++)
+            {
+                if(t==u)
+                    continue;
+                A[idx[u]][idx[u]] += W[u][t];
+                if(t!=r)
+                    A[idx[u]][idx[t]] -= W[u][t];
+            }
+            A[idx[u]][m+idx[u]] = 1;
+        }
+        //Gauss-Jordan with partial pivoting
+        for(int c=0;c<m;c++)
+        {
+            int best = c;
+            for(int i=c+1;i<m;i++)
+                if(std::fabs(A[i][c])>std::fabs(A[best][c]))
+                    best = i;
+            std::swap(A[c],A[best]);
+            double pivot = A[c][c];
+            for(int k=0;k<2*m;k++)
+                A[c][k] /= pivot;
+            for(int i=0;i<m;i++)
+            {
+                if(i==c || A[i][c]==0)
+                    continue;
+                double f = A[i][c];
+                for(int k=0;k<2*m;k++)
+                    A[i][k] -= f*A[c][k];
+            }
+        }
+        for(int u=0;u<n_vertices;u++)
+        {
+            if(u==r)
+                continue;
+            double Guu = A[idx[u]][m+idx[u]];
+            for(int t=0;t<n_vertices;t++)
+            {
+                if(t==u || W[u][t]==0)
+                    continue;
+                double Gtu = t==r ? 0 : A[idx[t]][m+idx[u]];
+                P[u][t] += W[u][t]*(Guu-Gtu)/n_vertices;
+            }
+        }
+    }
+    return P;
+}
+
+/*
+Expected output of the samplers: uniform roots, and for the input edge a->b
+the probability that a is the parent of b
+*/
+void expected(const matrix_t& P,const edge_list_t& edges,
+    std::vector<double>* root,std::vector<double>* edge)
+{
+    int n_vertices = P.size();
+    root->assign(n_vertices,1.0/n_vertices);
+    edge->clear();
+    for(size_t j=0;j<edges.size();j++)
+        edge->push_back(P[boost::get<1>(edges[j])][boost::get<0>(edges[j])]);
+}
+
+/*
+Upper alpha quantile of the standard normal
+*/
+double normalQuantile(double alpha)
+{
+    double lo = 0, hi = 40;
+    for(int it=0;it<200;it++)
+    {
+        double mid = (lo+hi)/2;
+        if(0.5*std::erfc(mid/std::sqrt(2.0))>alpha)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+Upper alpha quantile of the chi-square distribution (Wilson-Hilferty)
+*/
+double chiSquareQuantile(double df,double alpha)
+{
+    double z = normalQuantile(alpha);
+    double a = 2/(9*df);
+    return df*std::pow(1-a+z*std::sqrt(a),3);
+}
+
+void writeGraph(int n_vertices,const edge_list_t& edges)
+{
+    std::ofstream out (GRAPH.c_str());
+    out.precision(17);
+    out<<n_vertices<<"\n";
+    for(size_t j=0;j<edges.size();j++)
+        out<<boost::get<0>(edges[j])<<","<<boost::get<1>(edges[j])<<","<<boost::get<2>(edges[j])<<"\n";
+}
+
+/*
+Run the sampler, read its estimates (of weight column 'column') and the ESS
+it reports for a reused bank (-1 if no bank was reused)
+*/
+bool runSampler(std::string args,std::vector<double>* root,std::vector<double>* edge,double* ess,
+    int column=0)
+{
+    std::string cmd = SAMPLER+" "+GRAPH+" "+RESULT+" "+args;
+    FILE* p = popen(cmd.c_str(),"r");
+    if(p==NULL)
+        return false;
+    char buf[4096];
+    *ess = -1;
+    while(fgets(buf,sizeof(buf),p)!=NULL)
+    {
+        std::string line (buf);
+        size_t at = line.find("ESS=");
+        if(line.compare(0,6,"[bank]")==0 && at!=std::string::npos)
+            *ess = atof(line.c_str()+at+4);
+        if(line.compare(0,6,"[bank]")==0 && line.find("sampling new trees")!=std::string::npos)
+            *ess = -1;
+    }
+    if(pclose(p)!=0)
+        return false;
+    std::ifstream in (RESULT.c_str());
+    std::string line;
+    double x;
+    root->clear();
+    edge->clear();
+    for(int k=0;k<2*column;k++)
+        if(!getline(in,line))
+            return false;
+    if(!getline(in,line))
+        return false;
+    std::istringstream roots (line);
+    while(roots>>x)
+        root->push_back(x);
+    if(!getline(in,line))
+        return false;
+    std::istringstream edges (line);
+    while(edges>>x)
+        edge->push_back(x);
+    return true;
+}
+
+/*
+Compare estimates from n_samples trees (or effective samples) with the exact
+probabilities
+*/
+void compare(std::string name,std::string args,double n_samples,
+    const std::vector<double>& root,const std::vector<double>& edge,
+    const std::vector<double>& rootExact,const std::vector<double>& edgeExact)
+{
+    //Roots: chi-square against the uniform distribution
+    double chi2 = 0;
+    for(size_t i=0;i<root.size();i++)
+        chi2 += n_samples*(root[i]-rootExact[i])*(root[i]-rootExact[i])/rootExact[i];
+    double chi2Max = chiSquareQuantile(root.size()-1,ALPHA/2);
+    //Edges: z-scores, Bonferroni over all edges
+    double zMax = normalQuantile(ALPHA/4/edge.size());
+    double worst = 0;
+    size_t worstEdge = 0;
+    for(size_t j=0;j<edge.size();j++)
+    {
+        double p = edgeExact[j];
+        double sd = std::sqrt(std::max(p*(1-p),1e-12)/n_samples);
+        double z = std::fabs(edge[j]-p)/sd;
+        if(z>worst)
+        {
+            worst = z;
+            worstEdge = j;
+        }
+    }
+    bool ok = chi2<=chi2Max && worst<=zMax;
+    std::cout<<(ok?"ok   ":"FAIL ")<<name<<" ("<<args<<") chi2="<<chi2<<"/"<<chi2Max
+             <<" max|z|="<<worst<<"/"<<zMax<<" at edge "<<worstEdge
+             <<" ("<<edge[worstEdge]<<" vs "<<edgeExact[worstEdge]<<")"<<std::endl;
+    if(!ok)
+        failures++;
+}
+
+/*
+Compare one sampler run of n_samples trees (or effective samples) with the
+exact probabilities
+*/
+void check(std::string name,std::string args,double n_samples,
+    const std::vector<double>& rootExact,const std::vector<double>& edgeExact,int column=0)
+{
+    std::vector<double> root, edge;
+    double ess;
+    if(!runSampler(args,&root,&edge,&ess,column) || root.size()!=rootExact.size() || edge.size()!=edgeExact.size())
+    {
+        std::cout<<"FAIL "<<name<<" ("<<args<<"): sampler failed"<<std::endl;
+        failures++;
+        return;
+    }
+    if(ess>0)
+        n_samples = ess;
+    compare(name,args,n_samples,root,edge,rootExact,edgeExact);
+}
+
+
+/*
+Run the sampler with PAIRS and compare every pair of distinct input edges
+(a pair of copies of one edge is not reported) with its exact probability
+pairs[b_i*N+a_i][b_j*N+a_j] for edges a_i->b_i and a_j->b_j
+*/
+void checkPairs(std::string name,std::string args,double n_samples,int n_vertices,
+    const edge_list_t& edges,const matrix_t& pairs)
+{
+    std::vector<double> root, edge;
+    double ess;
+    size_t E = edges.size();
+    std::vector<std::vector<double> > estimate (E,std::vector<double>(E,0));
+    remove((RESULT+".pairs").c_str());
+    bool ran = runSampler(args,&root,&edge,&ess);
+    std::ifstream in ((RESULT+".pairs").c_str());
+    if(!ran || !in.is_open())
+    {
+        std::cout<<"FAIL "<<name<<" ("<<args<<"): sampler failed"<<std::endl;
+        failures++;
+        return;
+    }
+    std::string line;
+    while(getline(in,line))
+    {
+        int i, j;
+        double p;
+        if(line.empty() || line[0]=='#' || sscanf(line.c_str(),"%d %d %lf",&i,&j,&p)!=3)
+            continue;
+        if(i>=0 && j>=0 && (size_t)i<E && (size_t)j<E)
+            estimate[i][j] = p;
+    }
+    std::vector<boost::tuple<size_t,size_t,double> > tests;
+    for(size_t i=0;i<E;i++)
+    {
+        for(size_t j=i+1;j<E;j++)
+        {
+            int ai = boost::get<0>(edges[i]), bi = boost::get<1>(edges[i]);
+            int aj = boost::get<0>(edges[j]), bj = boost::get<1>(edges[j]);
+            if(ai==aj && bi==bj)
+                continue;
+            tests.push_back(boost::make_tuple(i,j,pairs[bi*n_vertices+ai][bj*n_vertices+aj]));
+        }
+    }
+    double zMax = normalQuantile(ALPHA/2/tests.size());
+    double worst = 0;
+    size_t worstTest = 0;
+    for(size_t k=0;k<tests.size();k++)
+    {
+        double p = boost::get<2>(tests[k]);
+        double sd = std::sqrt(std::max(p*(1-p),1e-12)/n_samples);
+        double z = std::fabs(estimate[boost::get<0>(tests[k])][boost::get<1>(tests[k])]-p)/sd;
+        if(z>worst)
+        {
+            worst = z;
+            worstTest = k;
+        }
+    }
+    size_t i = boost::get<0>(tests[worstTest]), j = boost::get<1>(tests[worstTest]);
+    bool ok = worst<=zMax;
+    std::cout<<(ok?"ok   ":"FAIL ")<<name<<" ("<<args<<") "<<tests.size()<<" pairs, max|z|="<<worst<<"/"<<zMax
+             <<" at edges "<<i<<","<<j<<" ("<<estimate[i][j]<<" vs "<<boost::get<2>(tests[worstTest])<<")"<<std::endl;
+    if(!ok)
+        failures++;
+}
+
+/*
+Run the sampler with a sketch too narrow for the pairs of the graph: every
+reported pair must still be no more frequent than either of its edges
+*/
+void checkPairBounds(std::string name,std::string args,size_t n_edges)
+{
+    std::vector<double> root, edge;
+    double ess;
+    remove((RESULT+".pairs").c_str());
+    bool ran = runSampler(args,&root,&edge,&ess);
+    std::ifstream in ((RESULT+".pairs").c_str());
+    if(!ran || !in.is_open())
+    {
+        std::cout<<"FAIL "<<name<<" ("<<args<<"): sampler failed"<<std::endl;
+        failures++;
+        return;
+    }
+    std::string line;
+    int n_pairs = 0, bad = 0;
+    while(getline(in,line))
+    {
+        int i, j;
+        double p;
+        if(line.empty() || line[0]=='#' || sscanf(line.c_str(),"%d %d %lf",&i,&j,&p)!=3)
+            continue;
+        n_pairs++;
+        if(i<0 || j<0 || (size_t)i>=n_edges || (size_t)j>=n_edges || p>std::min(edge[i],edge[j])+1e-5)
+            bad++;
+    }
+    bool ok = n_pairs>0 && bad==0;
+    std::cout<<(ok?"ok   ":"FAIL ")<<name<<" ("<<args<<") "<<n_pairs<<" pairs, "<<bad
+             <<" more frequent than an edge"<<std::endl;
+    if(!ok)
+        failures++;
+}
+
+/*
+Run every engine and weighting mode on one graph
+*/
+void testGraph(std::string name,int n_vertices,const edge_list_t& edges,bool brute)
+{
+    std::cout<<"----------- "<<name<<" ------------"<<std::endl;
+    writeGraph(n_vertices,edges);
+    int maxits = 20000;
+    std::string its = std::to_string((long long)maxits);
+    const char* engines[] = {"ENGINE=bgl","ENGINE=csr","REORDER=bfs","REORDER=rcm","REORDER=degree",
+                             "ENGINE=parallel THREADS=4"};
+    for(int weighted=0;weighted<=1;weighted++)
+    {
+        matrix_t W = walkWeights(n_vertices,edges,weighted);
+        matrix_t P = brute ? bruteForce(W) : matrixTree(W);
+        if(brute)
+        {
+            //The two oracles must agree
+            matrix_t Q = matrixTree(W);
+            double diff = 0;
+            for(int u=0;u<n_vertices;u++)
+                for(int t=0;t<n_vertices;t++)
+                    diff = std::max(diff,std::fabs(P[u][t]-Q[u][t]));
+            std::cout<<(diff<1e-9?"ok   ":"FAIL ")<<"brute force vs matrix-tree, max diff="<<diff<<std::endl;
+            if(diff>=1e-9)
+                failures++;
+        }
+        std::vector<double> rootExact, edgeExact;
+        expected(P,edges,&rootExact,&edgeExact);
+        std::string mode = std::to_string((long long)weighted);
+        for(int e=0;e<6;e++)
+            check(name,mode+" "+its+" SEED=11 "+engines[e],maxits,rootExact,edgeExact);
+        check(name,mode+" "+its+" SEED=12 ENGINE=csr CHAINS=3",3.0*maxits,rootExact,edgeExact);
+    }
+
+    if(brute)
+    {
+        //Edge pairs, exact counts of all edges and the sketch of all pairs
+        std::cout<<"----------- "<<name<<" (edge pairs) ------------"<<std::endl;
+        matrix_t pairs;
+        bruteForce(walkWeights(n_vertices,edges,1),&pairs);
+        std::ofstream selected (PAIRS.c_str());
+        for(size_t j=0;j<edges.size();j++)
+            selected<<j<<"\n";
+        selected.close();
+        for(int e=0;e<2;e++)
+        {
+            checkPairs(name,std::string("1 ")+its+" SEED=16 PAIRS="+PAIRS+" "+engines[e],maxits,n_vertices,edges,pairs);
+            checkPairs(name,std::string("1 ")+its+" SEED=16 PAIRS=all HEAVY=1000 CHAINS=2 "+engines[e],
+                       2.0*maxits,n_vertices,edges,pairs);
+        }
+        remove(PAIRS.c_str());
+    }
+
+    //Sketch estimates capped by the edge frequencies
+    checkPairBounds(name,"1 2000 SEED=17 PAIRS=all PAIRMEM=1 CHAINS=3 HEAVY=3200 ENGINE=csr",edges.size());
+
+    //Bank sampled under the weights scaled by up to 20%, reweighted to the true weights
+    std::cout<<"----------- "<<name<<" (reweighted bank) ------------"<<std::endl;
+    edge_list_t shifted = edges;
+    boost::random::mt19937 rng (3);
+    boost::random::uniform_real_distribution<> factor (0.8,1.2);
+    for(size_t j=0;j<shifted.size();j++)
+        boost::get<2>(shifted[j]) *= factor(rng);
+    writeGraph(n_vertices,shifted);
+    remove(BANK.c_str());
+    std::vector<double> root, edge;
+    double ess;
+    if(!runSampler("1 "+its+" SEED=13 BANK="+BANK,&root,&edge,&ess))
+    {
+        std::cout<<"FAIL "<<name<<": could not fill the bank"<<std::endl;
+        failures++;
+    }
+    writeGraph(n_vertices,edges);
+    matrix_t P = brute ? bruteForce(walkWeights(n_vertices,edges,1)) : matrixTree(walkWeights(n_vertices,edges,1));
+    std::vector<double> rootExact, edgeExact;
+    expected(P,edges,&rootExact,&edgeExact);
+    for(int e=0;e<2;e++)
+        check(name,std::string("1 ")+its+" MINESS=0 BANK="+BANK+" "+engines[e],maxits,rootExact,edgeExact);
+    remove(BANK.c_str());
+
+    //A bank of about 2 trees per root ignores the new weights: it must be resampled
+    writeGraph(n_vertices,shifted);
+    std::string few = std::to_string((long long)2*n_vertices);
+    if(!runSampler("1 "+few+" SEED=15 BANK="+BANK,&root,&edge,&ess))
+    {
+        std::cout<<"FAIL "<<name<<": could not fill the small bank"<<std::endl;
+        failures++;
+    }
+    writeGraph(n_vertices,edges);
+    std::string args = std::string("1 ")+its+" MINESS=0 BANK="+BANK;
+    if(!runSampler(args,&root,&edge,&ess) || ess>0)
+    {
+        std::cout<<"FAIL "<<name<<" ("<<args<<"): bank of "<<few<<" trees reused"<<std::endl;
+        failures++;
+    }
+    else
+        compare(name,args+" after "+few+" banked",maxits,root,edge,rootExact,edgeExact);
+    remove(BANK.c_str());
+
+    //Both weight vectors sampled together, each against its own exact values
+    std::cout<<"----------- "<<name<<" (weight columns) ------------"<<std::endl;
+    std::ofstream columns (WEIGHTS.c_str());
+    columns.precision(17);
+    for(size_t j=0;j<edges.size();j++)
+        columns<<boost::get<2>(edges[j])<<","<<boost::get<2>(shifted[j])<<"\n";
+    columns.close();
+    matrix_t Q = brute ? bruteForce(walkWeights(n_vertices,shifted,1)) : matrixTree(walkWeights(n_vertices,shifted,1));
+    std::vector<double> rootShifted, edgeShifted;
+    expected(Q,shifted,&rootShifted,&edgeShifted);
+    for(int e=1;e<3;e++)
+    {
+        std::string args = std::string("1 ")+its+" SEED=14 WEIGHTS="+WEIGHTS+" "+engines[e];
+        check(name+" column 0",args,maxits,rootExact,edgeExact,0);
+        check(name+" column 1",args,maxits,rootShifted,edgeShifted,1);
+    }
+    remove(WEIGHTS.c_str());
+}
+
+/*
+4 node grid with distinct weights (tc1.tc)
+*/
+void tc1()
+{
+    edge_list_t edges =
+    {
+        boost::make_tuple(0,1,10), boost::make_tuple(1,0,120),
+        boost::make_tuple(3,1,100), boost::make_tuple(1,3,10),
+        boost::make_tuple(2,3,110), boost::make_tuple(3,2,15),
+        boost::make_tuple(0,2,100), boost::make_tuple(2,0,10)
+    };
+    testGraph("4 Node Grid",4,edges,true);
+}
+
+/*
+4 node fully connected graph with a duplicated edge
+*/
+void tc2()
+{
+    edge_list_t edges =
+    {
+        boost::make_tuple(0,1,1), boost::make_tuple(1,0,2),
+        boost::make_tuple(3,1,3), boost::make_tuple(1,3,1),
+        boost::make_tuple(2,3,2), boost::make_tuple(3,2,5),
+        boost::make_tuple(0,2,1), boost::make_tuple(2,0,4),
+        boost::make_tuple(0,3,2), boost::make_tuple(3,0,1),
+        boost::make_tuple(1,2,3), boost::make_tuple(2,1,1),
+        boost::make_tuple(0,1,2)
+    };
+    testGraph("4 Node Fully Connected + Duplicate",4,edges,true);
+}
+
+/*
+2x2 grid with a cycle through two extra vertices
+*/
+void tc3()
+{
+    edge_list_t edges =
+    {
+        boost::make_tuple(0,1,10), boost::make_tuple(1,0,10),
+        boost::make_tuple(3,1,20), boost::make_tuple(1,3,10),
+        boost::make_tuple(2,3,10), boost::make_tuple(3,2,30),
+        boost::make_tuple(0,2,10), boost::make_tuple(2,0,10),
+        boost::make_tuple(0,4,5), boost::make_tuple(4,0,10),
+        boost::make_tuple(4,5,10), boost::make_tuple(5,4,10),
+        boost::make_tuple(5,3,10), boost::make_tuple(3,5,10)
+    };
+    testGraph("6 Node Grid + Cycle",6,edges,true);
+}
+
+/*
+5x5 grid with random weights (matrix-tree oracle)
+*/
+void tc4()
+{
+    int side = 5;
+    edge_list_t edges;
+    boost::random::mt19937 rng (1);
+    boost::random::uniform_real_distribution<> weight (0.5,5);
+    for(int r=0;r<side;r++)
+    {
+        for(int c=0;c<side;c++)
+        {
+            int v = r*side+c;
+            if(c+1<side)
+            {
+                edges.push_back(boost::make_tuple(v,v+1,weight(rng)));
+                edges.push_back(boost::make_tuple(v+1,v,weight(rng)));
+            }
+            if(r+1<side)
+            {
+                edges.push_back(boost::make_tuple(v,v+side,weight(rng)));
+                edges.push_back(boost::make_tuple(v+side,v,weight(rng)));
+            }
+        }
+    }
+    testGraph("5x5 Grid",side*side,edges,false);
+}
+
+int main()
+{
+    tc1();
+    tc2();
+    tc3();
+    tc4();
+    remove(GRAPH.c_str());
+    remove(RESULT.c_str());
+    remove((RESULT+".diag").c_str());
+    remove((RESULT+".pairs").c_str());
+    std::cout<<"----------- "<<(failures==0?"All tests passed":"Failures: "+std::to_string((long long)failures))
+             <<" ------------"<<std::endl;
+    return failures==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,233 @@
+/* Smoke test of the server mode over its Unix domain socket
+ *
+ * Starts MCMC_spanning_tree --serve, sends sampling requests (a new graph,
+ * a cached graph by hash, rejected requests and a graph the samplers fail
+ * on) on one connection and checks the shape of every response and that
+ * the connection stays usable after errors. A second server with one worker
+ * checks that idle connections neither hold the worker nor stay open.
+ *
+ * Usage : ./spanning_tree_server_test   (exits with EXIT_FAILURE on any failure)
+ */
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+std::string SAMPLER = "./MCMC_spanning_tree";
+std::string SOCKET  = "server_test.sock";
+//4 node grid (tc1.tc)
+std::string GRAPH   = "4\n0,1,10\n1,0,120\n3,1,100\n1,3,10\n2,3,110\n3,2,15\n0,2,100\n2,0,10\n";
+int failures = 0;
+
+/*
+Report one test
+*/
+void expect(bool ok,std::string name,std::string got)
+{
+    std::cout<<(ok?"ok   ":"FAIL ")<<name;
+    if(!ok)
+        std::cout<<" (got \""<<got<<"\")";
+    std::cout<<std::endl;
+    if(!ok)
+        failures++;
+}
+
+/*
+Start the server, return its pid
+*/
+pid_t startServer(std::vector<std::string> args)
+{
+    pid_t pid = fork();
+    if(pid==0)
+    {
+        std::vector<char*> argv;
+        argv.push_back((char*)SAMPLER.c_str());
+        argv.push_back((char*)"--serve");
+        argv.push_back((char*)SOCKET.c_str());
+        for(size_t a=0;a<args.size();a++)
+            argv.push_back((char*)args[a].c_str());
+        argv.push_back(NULL);
+        freopen("/dev/null","w",stdout);
+        execv(SAMPLER.c_str(),&argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+Connect to the server, retrying while it starts. Reads time out after 30s
+so that a server that does not answer fails the test instead of hanging it.
+*/
+int connectServer()
+{
+    for(int attempt=0;attempt<100;attempt++)
+    {
+        int fd = socket(AF_UNIX,SOCK_STREAM,0);
+        struct sockaddr_un addr;
+        memset(&addr,0,sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path,SOCKET.c_str(),sizeof(addr.sun_path)-1);
+        if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))==0)
+        {
+            struct timeval timeout = {30,0};
+            setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+            return fd;
+        }
+        close(fd);
+        usleep(50000);
+    }
+    return -1;
+}
+
+/*
+Send a request: parameters and either a graph or a hash
+*/
+void sendRequest(int fd,std::string params,std::string graph,std::string hash)
+{
+    std::string req = "SAMPLE "+params+"\n";
+    if(hash.empty())
+        req += "GRAPH "+std::to_string((long long)graph.size())+"\n"+graph;
+    else
+        req += "HASH "+hash+"\n";
+    if(write(fd,req.c_str(),req.size())!=(ssize_t)req.size())
+        std::cerr<<"short write"<<std::endl;
+}
+
+/*
+Read one line of the response
+*/
+std::string readLine(int fd)
+{
+    std::string line;
+    char c;
+    while(read(fd,&c,1)==1 && c!='\n')
+        line += c;
+    return line;
+}
+
+/*
+Number of values on a line
+*/
+int countValues(std::string line)
+{
+    std::istringstream in (line);
+    double x;
+    int n = 0;
+    while(in>>x)
+        n++;
+    return n;
+}
+
+/*
+Read an OK response with its root and edge lines, return the hash ("" if not OK)
+*/
+std::string readResult(int fd,std::string name)
+{
+    std::string status = readLine(fd);
+    if(status.compare(0,3,"OK ")!=0)
+    {
+        expect(false,name,status);
+        return "";
+    }
+    std::string roots = readLine(fd), edges = readLine(fd);
+    expect(countValues(roots)==4 && countValues(edges)==8,name,roots+" / "+edges);
+    return status.substr(3);
+}
+
+int main()
+{
+    //Parameters the server cannot honour are refused at startup
+    pid_t pid = startServer(std::vector<std::string>(1,"WEIGHTS=weights.txt"));
+    int status;
+    waitpid(pid,&status,0);
+    expect(WIFEXITED(status) && WEXITSTATUS(status)!=0,"--serve rejects WEIGHTS","exit status "+std::to_string((long long)status));
+
+    pid = startServer(std::vector<std::string>(1,"WORKERS=2"));
+    int fd = connectServer();
+    if(fd<0)
+    {
+        expect(false,"connect to the server","no connection");
+        kill(pid,SIGTERM);
+        waitpid(pid,&status,0);
+        return EXIT_FAILURE;
+    }
+    sendRequest(fd,"MAXITS=100",GRAPH,"");
+    std::string hash = readResult(fd,"new graph");
+    sendRequest(fd,"MAXITS=100 CHAINS=2 ENGINE=csr",GRAPH,"");
+    readResult(fd,"new graph, csr engine, 2 chains");
+    sendRequest(fd,"MAXITS=100",GRAPH,hash);
+    expect(readResult(fd,"cached graph by hash")==hash,"same hash",hash);
+    sendRequest(fd,"MAXITS=100 FOO=1 BAR=2",GRAPH,"");
+    std::string line = readLine(fd);
+    expect(line=="ERROR invalid parameter FOO=1","one error for invalid parameters",line);
+    sendRequest(fd,"MAXITS=100 PAIRS=all",GRAPH,"");
+    line = readLine(fd);
+    expect(line=="ERROR invalid parameter PAIRS=all","PAIRS rejected in a request",line);
+    sendRequest(fd,"MAXITS=100",GRAPH,hash);
+    readResult(fd,"connection usable after rejected requests");
+    sendRequest(fd,"MAXITS=100",GRAPH,"0123456789abcdef");
+    line = readLine(fd);
+    expect(line.compare(0,20,"ERROR unknown graph ")==0,"unknown hash",line);
+    //No reverse edges: every chain fails, the server must survive
+    sendRequest(fd,"MAXITS=10 CHAINS=2","3\n0,1,1\n1,2,1\n2,0,1\n","");
+    line = readLine(fd);
+    expect(line.compare(0,6,"ERROR ")==0,"sampling error reported",line);
+    sendRequest(fd,"MAXITS=100",GRAPH,hash);
+    readResult(fd,"server alive after a sampling error");
+    //Vertex ids outside [0,N-1], and vertices without edges
+    sendRequest(fd,"MAXITS=10","2\n-1,0,1\n0,1,1\n1,0,1\n","");
+    line = readLine(fd);
+    expect(line.compare(0,6,"ERROR ")==0,"negative vertex id rejected",line);
+    sendRequest(fd,"MAXITS=10","2\n0,1,1\n1,2,1\n2,1,1\n","");
+    line = readLine(fd);
+    expect(line.compare(0,6,"ERROR ")==0,"vertex id N rejected",line);
+    sendRequest(fd,"MAXITS=10","6\n0,1,1\n1,0,1\n","");
+    line = readLine(fd);
+    expect(line.compare(0,6,"ERROR ")==0,"vertices without edges reported",line);
+    sendRequest(fd,"MAXITS=100",GRAPH,hash);
+    readResult(fd,"server alive after invalid graphs");
+    close(fd);
+    kill(pid,SIGTERM);
+    waitpid(pid,&status,0);
+
+    //One worker: an idle connection must not hold it, and idle or excess
+    //connections are closed
+    std::vector<std::string> settings;
+    settings.push_back("WORKERS=1");
+    settings.push_back("IDLE=2");
+    settings.push_back("CONNECTIONS=2");
+    pid = startServer(settings);
+    int idle = connectServer();
+    fd = connectServer();
+    int excess = connectServer();
+    line = readLine(excess);
+    expect(line=="ERROR too many connections","connections above the cap refused",line);
+    close(excess);
+    sendRequest(fd,"MAXITS=100",GRAPH,"");
+    readResult(fd,"request answered while another connection is idle");
+    sleep(3);
+    char c;
+    expect(read(idle,&c,1)==0,"idle connection closed","data or timeout");
+    close(idle);
+    close(fd);
+    fd = connectServer();
+    sendRequest(fd,"MAXITS=100",GRAPH,"");
+    readResult(fd,"new connection after idle ones closed");
+    close(fd);
+
+    kill(pid,SIGTERM);
+    waitpid(pid,&status,0);
+    unlink(SOCKET.c_str());
+    std::cout<<"----------- "<<(failures==0?"All tests passed":"Failures: "+std::to_string((long long)failures))
+             <<" ------------"<<std::endl;
+    return failures==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}